@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+/* 記録先 */
+// 起動時に1回だけ開き、fork後のワーカーもマップを共有して追記する
+static struct {
+    int fd;
+    char *base;                 // ACCESSLOG_MAXをマップした先頭（見出し）
+    struct accesslog_hdr *hdr;
+    uint64_t cap;               // 記録できる最大件数
+    size_t size;                // 伸ばしたことが分かっているファイルの大きさ
+} g_alog = {-1, NULL, NULL, 0, 0};
+
+/* 現在時刻（エポックからのナノ秒） */
+static uint64_t
+wall_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+/* ファイルをsizeまで伸ばす */
+// posix_fallocateは縮めないので、複数のスレッドやプロセスが同時に呼んでもよい
+// 0:成功 -1:エラー
+static int
+accesslog_grow(size_t size)
+{
+    size_t known;
+    int err;
+
+    known = __atomic_load_n(&g_alog.size, __ATOMIC_RELAXED);
+    if (size <= known) {
+        return (0);
+    }
+    size = (size + ACCESSLOG_GROW - 1) / ACCESSLOG_GROW * ACCESSLOG_GROW;
+    if ((err = posix_fallocate(g_alog.fd, 0, (off_t) size)) != 0) {
+        errno = err;
+        perror("posix_fallocate");
+        return (-1);
+    }
+    while (known < size
+            && !__atomic_compare_exchange_n(&g_alog.size, &known, size, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return (0);
+}
+
+/* アクセスログを開く */
+// 既存のファイルなら形式を確かめて続きに追記する
+// 共有マップに書くので、プロセスが異常終了しても書き終えた記録は残る
+// 0:成功 -1:エラー
+int
+accesslog_open(const char *path)
+{
+    struct accesslog_hdr *hdr;
+    struct stat st;
+
+    if ((g_alog.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+        perror("open");
+        return (-1);
+    }
+    if (fstat(g_alog.fd, &st) == -1) {
+        perror("fstat");
+        (void) close(g_alog.fd);
+        return (-1);
+    }
+    g_alog.size = (size_t) st.st_size;
+    if (accesslog_grow(ACCESSLOG_HDR_SIZE) == -1) {
+        (void) close(g_alog.fd);
+        return (-1);
+    }
+    // ファイルより先の部分も予約だけしておき、伸ばしたところから使う
+    if ((g_alog.base = mmap(NULL, ACCESSLOG_MAX, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            g_alog.fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(g_alog.fd);
+        return (-1);
+    }
+    hdr = (struct accesslog_hdr *) g_alog.base;
+    if (hdr->magic == 0) {
+        hdr->version = ACCESSLOG_VERSION;
+        hdr->rec_size = sizeof(struct access_rec);
+        __atomic_store_n(&hdr->magic, ACCESSLOG_MAGIC, __ATOMIC_RELEASE);
+    } else if (hdr->magic != ACCESSLOG_MAGIC || hdr->version != ACCESSLOG_VERSION
+            || hdr->rec_size != sizeof(struct access_rec)) {
+        (void) fprintf(stderr, "%s:not an access log\n", path);
+        (void) munmap(g_alog.base, ACCESSLOG_MAX);
+        (void) close(g_alog.fd);
+        return (-1);
+    }
+    g_alog.cap = (ACCESSLOG_MAX - ACCESSLOG_HDR_SIZE) / sizeof(struct access_rec);
+    __atomic_store_n(&g_alog.hdr, hdr, __ATOMIC_RELEASE);
+    return (0);
+}
+
+/* アクセスログを記録しているか */
+int
+accesslog_enabled(void)
+{
+    return (__atomic_load_n(&g_alog.hdr, __ATOMIC_ACQUIRE) != NULL);
+}
+
+/* 接続の集計の開始 */
+void
+access_begin(struct access_info *ai, const struct sockaddr *sa, socklen_t len)
+{
+    (void) memset(ai, 0, sizeof(*ai));
+    if (len > (socklen_t) sizeof(ai->from)) {
+        len = (socklen_t) sizeof(ai->from);
+    }
+    (void) memcpy(&ai->from, sa, len);
+    ai->fromlen = len;
+    ai->reason = ACCESS_EOF;
+    if (g_alog.hdr != NULL) {
+        ai->accepted = wall_ns();
+    }
+}
+
+/* 切断時の記録 */
+// 件数を原子的に進めて場所を確保し、書き終えてからcommitを書く
+// 1件の書き込みでシステムコールを呼ぶのは、ファイルを伸ばすときだけ
+void
+access_end(const struct access_info *ai)
+{
+    struct accesslog_hdr *hdr;
+    struct access_rec *rec;
+    uint64_t idx;
+    size_t end;
+
+    if ((hdr = __atomic_load_n(&g_alog.hdr, __ATOMIC_ACQUIRE)) == NULL) {
+        return;
+    }
+    idx = __atomic_fetch_add(&hdr->count, 1, __ATOMIC_RELAXED);
+    if (idx >= g_alog.cap) {
+        // 一杯になったら記録しない（件数だけは進む）
+        return;
+    }
+    end = ACCESSLOG_HDR_SIZE + (size_t) (idx + 1) * sizeof(*rec);
+    if (accesslog_grow(end) == -1) {
+        return;
+    }
+    rec = (struct access_rec *) (g_alog.base + end - sizeof(*rec));
+    (void) memset(rec, 0, sizeof(*rec));
+    rec->family = (uint8_t) ai->from.ss_family;
+    if (ai->from.ss_family == AF_INET) {
+        (void) memcpy(rec->addr, &((const struct sockaddr_in *) &ai->from)->sin_addr, 4);
+        rec->port = ntohs(((const struct sockaddr_in *) &ai->from)->sin_port);
+    } else if (ai->from.ss_family == AF_INET6) {
+        (void) memcpy(rec->addr, &((const struct sockaddr_in6 *) &ai->from)->sin6_addr, 16);
+        rec->port = ntohs(((const struct sockaddr_in6 *) &ai->from)->sin6_port);
+    }
+    rec->reason = (uint8_t) ai->reason;
+    rec->accept_ns = ai->accepted;
+    rec->close_ns = wall_ns();
+    rec->bytes_in = ai->bytes_in;
+    rec->bytes_out = ai->bytes_out;
+    rec->requests = ai->requests;
+    __atomic_store_n(&rec->commit, ACCESSLOG_MAGIC, __ATOMIC_RELEASE);
+}
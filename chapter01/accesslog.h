@@ -0,0 +1,66 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdint.h>
+
+/* ファイルと書き終えた記録の識別子（"ALOG"） */
+#define ACCESSLOG_MAGIC 0x474f4c41
+/* 形式の版 */
+#define ACCESSLOG_VERSION 1
+/* 見出しの大きさ（記録はこの後ろから並ぶ） */
+#define ACCESSLOG_HDR_SIZE 4096
+/* マップする大きさ（ファイルはこれ以上伸ばさない） */
+#define ACCESSLOG_MAX ((size_t) 1024 * 1024 * 1024)
+/* ファイルを一度に伸ばす大きさ */
+#define ACCESSLOG_GROW ((size_t) 1024 * 1024)
+
+/* 切断の理由 */
+#define ACCESS_EOF 0        // 相手が送信を終え、応答を送りきった
+#define ACCESS_ERROR 1      // 送受信のエラーか相手の異常終了
+#define ACCESS_REJECT 2     // 不正なフレームかバッファを広げられず、サーバーから閉じた
+
+/* ファイルの見出し */
+struct accesslog_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;      // 1件の大きさ
+    // 確保済みの件数（書き込み途中の記録を含む）
+    uint64_t count __attribute__((aligned(64)));
+};
+
+/* 1接続分の記録（64バイト） */
+// 最後にcommitを書くので、書き込み途中で落ちた記録はcommitが0のまま残る
+struct access_rec {
+    uint32_t commit;        // 書き終えたらACCESSLOG_MAGIC
+    uint8_t family;         // AF_INET, AF_INET6, AF_UNIX
+    uint8_t reason;         // 切断の理由
+    uint16_t port;          // ポート番号（ホストバイトオーダー）
+    uint8_t addr[16];       // アドレス（IPv4は先頭4バイト）
+    uint64_t accept_ns;     // 受け付けた時刻（エポックからのナノ秒）
+    uint64_t close_ns;      // 切断した時刻（エポックからのナノ秒）
+    uint64_t bytes_in;      // 受信したバイト数
+    uint64_t bytes_out;     // 送信したバイト数
+    uint64_t requests;      // 処理した要求数
+};
+
+/* 接続ごとの集計 */
+// エンジンが接続の状態に持ち、切断時にaccess_endで記録する
+struct access_info {
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    int reason;
+    uint64_t accepted;
+    uint64_t bytes_in, bytes_out;
+    unsigned long requests;
+};
+
+/* accesslog.c */
+int accesslog_open(const char *path);
+int accesslog_enabled(void);
+void access_begin(struct access_info *ai, const struct sockaddr *sa, socklen_t len);
+void access_end(const struct access_info *ai);
+
+#endif
@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "metrics.h"
+
+/* 管理用ポートの応答を作るバッファのサイズ */
+#define ADMIN_OUT_SIZE 8192
+/* 管理用ポートで要求を待つ時間（秒） */
+#define ADMIN_RECV_TIMEOUT 1
+
+/* 管理用ポートの処理 */
+// 接続ごとに要求（HTTPのGETなど）を読み捨て、その時点の値を返して閉じる
+static void *
+admin_thread(void *arg)
+{
+    static const char hdr[] = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    char out[ADMIN_OUT_SIZE], req[1024];
+    struct timeval tv;
+    size_t len;
+    int soc = (int) (intptr_t) arg, acc;
+
+    for (;;) {
+        if ((acc = accept4(soc, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        // 何も送ってこない相手で止まらないように待ち時間を区切る
+        tv.tv_sec = ADMIN_RECV_TIMEOUT;
+        tv.tv_usec = 0;
+        (void) setsockopt(acc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        (void) recv(acc, req, sizeof(req), 0);
+        (void) memcpy(out, hdr, sizeof(hdr) - 1);
+        len = sizeof(hdr) - 1;
+        len += metrics_format(out + len, sizeof(out) - len);
+        (void) send(acc, out, len, MSG_NOSIGNAL);
+        (void) close(acc);
+    }
+    return (NULL);
+}
+
+/* 管理用ポートの開始 */
+// 送受信のループとは別のスレッドで待ち受ける
+// 0:成功 -1:エラー
+int
+admin_serve(const char *hostnm, const char *portnm)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int soc, err;
+
+    if ((soc = server_socket_by_hostname(hostnm, portnm, SOCK_STREAM, 0)) == -1) {
+        (void) fprintf(stderr, "server_socket(%s):error\n", portnm);
+        return (-1);
+    }
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, admin_thread, (void *) (intptr_t) soc);
+    (void) pthread_attr_destroy(&attr);
+    if (err != 0) {
+        (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+        (void) close(soc);
+        return (-1);
+    }
+    return (0);
+}
@@ -0,0 +1,153 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+/* 切断の理由の名前 */
+static const char *
+reason_name(int reason)
+{
+    static const char *names[] = {"eof", "error", "reject"};
+
+    if (reason < 0 || reason >= (int) (sizeof(names) / sizeof(names[0]))) {
+        return ("?");
+    }
+    return (names[reason]);
+}
+
+/* アドレスの文字列化 */
+static void
+addr_name(const struct access_rec *rec, char *buf, size_t size)
+{
+    if (rec->family == AF_INET) {
+        (void) inet_ntop(AF_INET, rec->addr, buf, (socklen_t) size);
+    } else if (rec->family == AF_INET6) {
+        (void) inet_ntop(AF_INET6, rec->addr, buf, (socklen_t) size);
+    } else if (rec->family == AF_UNIX) {
+        (void) snprintf(buf, size, "unix");
+    } else {
+        (void) snprintf(buf, size, "?");
+    }
+}
+
+/* 時刻の文字列化（UTC、マイクロ秒まで） */
+static void
+time_name(uint64_t ns, char *buf, size_t size)
+{
+    struct tm tm;
+    time_t t;
+    size_t n;
+
+    t = (time_t) (ns / 1000000000);
+    (void) gmtime_r(&t, &tm);
+    n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    (void) snprintf(buf + n, size - n, ".%06luZ", (unsigned long) (ns % 1000000000 / 1000));
+}
+
+/* 1件の出力 */
+static void
+print_rec(const struct access_rec *rec, int csv)
+{
+    char addr[INET6_ADDRSTRLEN], ts[64];
+
+    addr_name(rec, addr, sizeof(addr));
+    if (csv) {
+        (void) printf("%llu,%llu,%s,%u,%s,%llu,%llu,%llu\n",
+                        (unsigned long long) rec->accept_ns, (unsigned long long) rec->close_ns,
+                        addr, (unsigned) rec->port, reason_name(rec->reason),
+                        (unsigned long long) rec->bytes_in, (unsigned long long) rec->bytes_out,
+                        (unsigned long long) rec->requests);
+        return;
+    }
+    time_name(rec->accept_ns, ts, sizeof(ts));
+    (void) printf("%s %s%s%s:%u %s dur=%.3fms in=%llu out=%llu req=%llu\n", ts,
+                    rec->family == AF_INET6 ? "[" : "", addr, rec->family == AF_INET6 ? "]" : "",
+                    (unsigned) rec->port, reason_name(rec->reason),
+                    (rec->close_ns - rec->accept_ns) / 1e6,
+                    (unsigned long long) rec->bytes_in, (unsigned long long) rec->bytes_out,
+                    (unsigned long long) rec->requests);
+}
+
+/* バイナリのアクセスログの変換 */
+// serverの-Lで書いたファイルを1接続1行のテキスト（-cならCSV）にする
+// 書き込み途中で落ちた記録は飛ばし、その件数を標準エラーに出す
+int
+main(int argc, char *argv[])
+{
+    const struct accesslog_hdr *hdr;
+    const struct access_rec *rec;
+    struct stat st;
+    uint64_t count, i, torn = 0;
+    char *base;
+    int fd, ch, csv = 0;
+
+    while ((ch = getopt(argc, argv, "c")) != -1) {
+        switch (ch) {
+        case 'c':
+            csv = 1;
+            break;
+        default:
+            (void) fprintf(stderr, "alogdump [-c] accesslog\n");
+            return (EX_USAGE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1) {
+        (void) fprintf(stderr, "alogdump [-c] accesslog\n");
+        return (EX_USAGE);
+    }
+    if ((fd = open(argv[0], O_RDONLY)) == -1) {
+        perror(argv[0]);
+        return (EX_NOINPUT);
+    }
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < ACCESSLOG_HDR_SIZE) {
+        (void) fprintf(stderr, "%s:not an access log\n", argv[0]);
+        return (EX_DATAERR);
+    }
+    if ((base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (EX_OSERR);
+    }
+    hdr = (const struct accesslog_hdr *) base;
+    if (hdr->magic != ACCESSLOG_MAGIC || hdr->version != ACCESSLOG_VERSION
+            || hdr->rec_size != sizeof(*rec)) {
+        (void) fprintf(stderr, "%s:not an access log\n", argv[0]);
+        return (EX_DATAERR);
+    }
+    // 書いている途中のファイルでも、伸ばした範囲の中だけを読む
+    count = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+    if (count > ((size_t) st.st_size - ACCESSLOG_HDR_SIZE) / sizeof(*rec)) {
+        count = ((size_t) st.st_size - ACCESSLOG_HDR_SIZE) / sizeof(*rec);
+    }
+    if (csv) {
+        (void) printf("accept_ns,close_ns,addr,port,reason,bytes_in,bytes_out,requests\n");
+    }
+    rec = (const struct access_rec *) (base + ACCESSLOG_HDR_SIZE);
+    for (i = 0; i < count; i++) {
+        if (__atomic_load_n(&rec[i].commit, __ATOMIC_ACQUIRE) != ACCESSLOG_MAGIC) {
+            torn++;
+            continue;
+        }
+        print_rec(&rec[i], csv);
+    }
+    if (torn > 0) {
+        (void) fprintf(stderr, "%llu incomplete records skipped\n", (unsigned long long) torn);
+    }
+    (void) munmap(base, (size_t) st.st_size);
+    (void) close(fd);
+    return (EX_OK);
+}
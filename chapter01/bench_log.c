@@ -0,0 +1,122 @@
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* スレッド数 */
+#define THREADS 4
+/* 1スレッドあたりのメッセージ数 */
+#define MESSAGES 20000
+/* 続けて出すメッセージ数（要求がまとまって届く状況を模す） */
+#define BURST 500
+/* バーストの間隔（マイクロ秒） */
+#define BURST_GAP_US 2000
+
+/* 出し方 */
+struct method {
+    const char *name;
+    int async;      // 非同期ログを使う
+    int level;      // ログレベル（DEBUGのメッセージが捨てられるか）
+};
+
+/* スレッドごとの計測 */
+struct worker {
+    const struct method *m;
+    double *lat;
+};
+
+/* 経過時間（ナノ秒） */
+static double
+elapsed_ns(const struct timespec *s, const struct timespec *e)
+{
+    return ((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+/* 比較用のdouble */
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/* 要求1行分のログを出し続ける */
+static void *
+worker_run(void *arg)
+{
+    static const char line[] = "GET /index.html HTTP/1.1 host=example.com id=0123456789";
+    struct worker *w = arg;
+    struct timespec s, e;
+    int i;
+
+    for (i = 0; i < MESSAGES; i++) {
+        if (i > 0 && i % BURST == 0) {
+            (void) usleep(BURST_GAP_US);
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &s);
+        if (w->m->async) {
+            LOG(LOG_LEVEL_DEBUG, "[client]%.*s\n", (int) sizeof(line) - 1, line);
+        } else {
+            (void) fprintf(stderr, "[client]%.*s\n", (int) sizeof(line) - 1, line);
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &e);
+        w->lat[i] = elapsed_ns(&s, &e);
+    }
+    return (NULL);
+}
+
+/* 要求ごとのログのベンチマーク */
+// 複数のスレッドが要求ごとのログを出すときの1件あたりの時間を、
+// stderrへのfprintf、非同期ログ、レベルで無効にした非同期ログで比べる
+// 書き出し先の影響を受けるので ./bench_log 2>/dev/null や 2>file で実行する
+int
+main(void)
+{
+    static const struct method methods[] = {
+        {"fprintf", 0, LOG_LEVEL_DEBUG},
+        {"async", 1, LOG_LEVEL_DEBUG},
+        {"disabled", 1, LOG_LEVEL_INFO},
+    };
+    struct worker w[THREADS];
+    pthread_t tid[THREADS];
+    double *lat, sum;
+    size_t i, k, n;
+
+    n = (size_t) THREADS * MESSAGES;
+    if ((lat = malloc(n * sizeof(*lat))) == NULL) {
+        perror("malloc");
+        return (EXIT_FAILURE);
+    }
+    (void) printf("%-9s %10s %10s %10s %10s\n", "method", "avg(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)");
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (methods[i].async && log_init(methods[i].level) == -1) {
+            (void) fprintf(stderr, "log_init:error\n");
+            return (EXIT_FAILURE);
+        }
+        for (k = 0; k < THREADS; k++) {
+            w[k].m = &methods[i];
+            w[k].lat = lat + k * MESSAGES;
+            (void) pthread_create(&tid[k], NULL, worker_run, &w[k]);
+        }
+        for (k = 0; k < THREADS; k++) {
+            (void) pthread_join(tid[k], NULL);
+        }
+        log_flush();
+        sum = 0;
+        for (k = 0; k < n; k++) {
+            sum += lat[k];
+        }
+        qsort(lat, n, sizeof(*lat), cmp_double);
+        (void) printf("%-9s %10.0f %10.0f %10.0f %10.0f\n", methods[i].name,
+                        sum / n, lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000]);
+    }
+    free(lat);
+    return (EXIT_SUCCESS);
+}
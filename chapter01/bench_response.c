@@ -0,0 +1,152 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server.h"
+
+/* 1つの要求サイズあたりの繰り返し回数 */
+#define ITERATIONS 1000000
+/* 従来の受信兼応答バッファのサイズ */
+#define BUF_SIZE 512
+
+/* 応答作成の関数（受信バッファの行から応答を作り、応答の長さを返す） */
+typedef size_t (*build_func)(char *buf, size_t len, struct iovec *iov);
+
+/* 経過時間（ナノ秒） */
+static double
+elapsed_ns(const struct timespec *s, const struct timespec *e)
+{
+    return ((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+/* 従来の応答作成 */
+// 受信バッファの行末を終端にしてmystrlcatで接尾辞を足し、strlenで長さを求める
+static size_t
+build_strlcat(char *buf, size_t len, struct iovec *iov)
+{
+    (void) iov;
+    buf[len] = '\0';
+    (void) mystrlcat(buf, RESP_SUFFIX, BUF_SIZE);
+    return (strlen(buf));
+}
+
+/* iovecによる応答作成 */
+// 受信バッファと固定の接尾辞を指すだけ
+static size_t
+build_iov(char *buf, size_t len, struct iovec *iov)
+{
+    int i, n;
+    size_t total = 0;
+
+    n = line_response_iov(buf, len, iov);
+    for (i = 0; i < n; i++) {
+        total += iov[i].iov_len;
+    }
+    return (total);
+}
+
+/* 応答作成で受信兼応答バッファへ書き込んだバイト数 */
+// 行の後ろを2通りの値で埋めたバッファでそれぞれ1回作り、どちらかで値が変わったバイトを数える
+// 埋めた値と同じ値を書いたバイトも、もう一方のバッファでは変わるので数えられる
+static size_t
+written_bytes(build_func build, const char *line, size_t len)
+{
+    static const unsigned char poison[] = { 0x00, 0xff };
+    unsigned char buf[2][BUF_SIZE];
+    struct iovec iov[RESP_IOV];
+    size_t i, n = 0;
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        (void) memcpy(buf[k], line, len);
+        (void) memset(buf[k] + len, poison[k], BUF_SIZE - len);
+        (void) build((char *) buf[k], len, iov);
+    }
+    for (i = 0; i < BUF_SIZE; i++) {
+        for (k = 0; k < 2; k++) {
+            if (buf[k][i] != (i < len ? (unsigned char) line[i] : poison[k])) {
+                n++;
+                break;
+            }
+        }
+    }
+    return (n);
+}
+
+/* iovecの応答が従来の応答と同じ内容か */
+static int
+same_response(const char *line, size_t len)
+{
+    char buf[BUF_SIZE], *p;
+    struct iovec iov[RESP_IOV];
+    size_t rlen;
+    int i, n;
+
+    (void) memcpy(buf, line, len);
+    rlen = build_strlcat(buf, len, iov);
+    n = line_response_iov(line, len, iov);
+    for (i = 0, p = buf; i < n; p += iov[i].iov_len, i++) {
+        if (p + iov[i].iov_len > buf + rlen
+                || memcmp(p, iov[i].iov_base, iov[i].iov_len) != 0) {
+            return (0);
+        }
+    }
+    return (p == buf + rlen);
+}
+
+/* 応答作成のマイクロベンチマーク */
+// 要求の長さごとに、1要求あたりの時間と応答作成で書き込んだバイト数を比べる
+int
+main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 8, 64, 256, 500 };
+    char buf[BUF_SIZE];
+    struct iovec iov[RESP_IOV];
+    struct timespec s, e;
+    size_t i, k, copied, sink;
+    long iters;
+
+    iters = argc > 1 ? atol(argv[1]) : ITERATIONS;
+    if (iters <= 0) {
+        (void) fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return (EXIT_FAILURE);
+    }
+    (void) printf("%-6s %-8s %12s %14s\n", "len", "builder", "ns/req", "copied/req");
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        (void) memset(buf, 'a', sizes[k]);
+        if (!same_response(buf, sizes[k])) {
+            (void) fprintf(stderr, "response mismatch:len=%zu\n", sizes[k]);
+            return (EXIT_FAILURE);
+        }
+        /* 従来 */
+        // 書き込んだバイト数は時間を計るループの外で、実際に書き換わったバイトを数える
+        copied = written_bytes(build_strlcat, buf, sizes[k]);
+        sink = 0;
+        (void) clock_gettime(CLOCK_MONOTONIC, &s);
+        for (i = 0; i < (size_t) iters; i++) {
+            sink += build_strlcat(buf, sizes[k], iov);
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &e);
+        (void) printf("%-6zu %-8s %12.1f %14zu\n", sizes[k], "strlcat",
+                        elapsed_ns(&s, &e) / iters, copied);
+        /* iovec */
+        copied = written_bytes(build_iov, buf, sizes[k]);
+        (void) clock_gettime(CLOCK_MONOTONIC, &s);
+        for (i = 0; i < (size_t) iters; i++) {
+            sink += build_iov(buf, sizes[k], iov);
+            // 最適化で呼び出しが消えないようにする
+            __asm__ __volatile__("" : : "r" (iov) : "memory");
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &e);
+        (void) printf("%-6zu %-8s %12.1f %14zu\n", sizes[k], "iovec",
+                        elapsed_ns(&s, &e) / iters, copied);
+        if (sink == 0) {
+            return (EXIT_FAILURE);
+        }
+    }
+    return (EXIT_SUCCESS);
+}
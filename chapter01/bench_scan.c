@@ -0,0 +1,164 @@
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framer.h"
+#include "nlscan.h"
+
+/* 1つの分布あたりの受信データの大きさ */
+#define DATA_SIZE (1024 * 1024)
+/* 繰り返し回数 */
+#define ROUNDS 50
+
+/* 行の長さの分布 */
+struct dist {
+    const char *name;
+    size_t min, max;    // 改行を除いた長さの範囲（一様）
+    int pct;            // この割合(%)の行はmin_long..max_longにする
+    size_t min_long, max_long;
+};
+
+static const struct dist dists[] = {
+    {"short", 4, 12, 0, 0, 0},          // 小さなコマンドのパイプライン
+    {"mixed", 4, 32, 20, 64, 256},      // 大半は短く、時々長い
+    {"long", 128, 511, 0, 0, 0},        // 最大長に近い行
+};
+
+/* 経過時間（ナノ秒） */
+static double
+elapsed_ns(const struct timespec *s, const struct timespec *e)
+{
+    return ((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+/* 分布に従った行で受信データを作る */
+// 最後に\0を置いてstrpbrkでも扱えるようにする
+static size_t
+make_data(char *buf, size_t size, const struct dist *d)
+{
+    size_t len, n = 0;
+
+    srand(1);
+    for (;;) {
+        if (d->pct > 0 && rand() % 100 < d->pct) {
+            len = d->min_long + (size_t) rand() % (d->max_long - d->min_long + 1);
+        } else {
+            len = d->min + (size_t) rand() % (d->max - d->min + 1);
+        }
+        if (n + len + 2 > size) {
+            break;
+        }
+        (void) memset(buf + n, 'a' + (int) (len % 26), len);
+        n += len;
+        buf[n++] = '\n';
+    }
+    buf[n] = '\0';
+    return (n);
+}
+
+/* strpbrkで区切りを数える */
+static size_t
+count_strpbrk(const char *buf, size_t len)
+{
+    const char *p = buf;
+    size_t cnt = 0;
+
+    (void) len;
+    while ((p = strpbrk(p, "\r\n")) != NULL) {
+        cnt++;
+        p++;
+    }
+    return (cnt);
+}
+
+/* memchrで区切りを数える */
+// フレーマーの以前の探し方と同じく1行ごとに呼ぶ
+static size_t
+count_memchr(const char *buf, size_t len)
+{
+    const char *p = buf, *e = buf + len;
+    size_t cnt = 0;
+
+    while ((p = memchr(p, '\n', (size_t) (e - p))) != NULL) {
+        cnt++;
+        p++;
+    }
+    return (cnt);
+}
+
+/* nlscanで区切りを数える */
+// フレーマーと同じくFRAMER_NL個ずつまとめて見つける
+static size_t
+count_nlscan(nlscan_func scan, const char *buf, size_t len)
+{
+    unsigned pos[FRAMER_NL];
+    size_t n, from = 0, cnt = 0;
+
+    do {
+        n = scan(buf, from, len, pos, FRAMER_NL);
+        cnt += n;
+        from = n == FRAMER_NL ? pos[n - 1] + 1 : len;
+    } while (from < len);
+    return (cnt);
+}
+
+/* 区切り検索のマイクロベンチマーク */
+// 行の長さの分布ごとに、strpbrk・memchr・各SIMDカーネルで改行を数える時間を比べる
+int
+main(void)
+{
+    static const char *kernels[] = { "scalar", "sse2", "avx2", "auto" };
+    struct timespec s, e;
+    nlscan_func scan;
+    size_t i, k, len, lines, cnt;
+    char *buf, name[32];
+    double ns;
+    int r;
+
+    if ((buf = malloc(DATA_SIZE + 1)) == NULL) {
+        perror("malloc");
+        return (EXIT_FAILURE);
+    }
+    (void) printf("%-6s %-14s %10s %10s\n", "dist", "method", "ns/line", "GB/s");
+    for (k = 0; k < sizeof(dists) / sizeof(dists[0]); k++) {
+        len = make_data(buf, DATA_SIZE, &dists[k]);
+        lines = count_memchr(buf, len);
+        for (i = 0; i < 2 + sizeof(kernels) / sizeof(kernels[0]); i++) {
+            scan = NULL;
+            if (i >= 2) {
+                if ((scan = nlscan_find(kernels[i - 2])) == NULL) {
+                    (void) printf("%-6s nlscan/%-7s %10s\n", dists[k].name,
+                                    kernels[i - 2], "unsupported");
+                    continue;
+                }
+                (void) snprintf(name, sizeof(name), "nlscan/%s", kernels[i - 2]);
+            } else {
+                (void) snprintf(name, sizeof(name), "%s", i == 0 ? "strpbrk" : "memchr");
+            }
+            (void) clock_gettime(CLOCK_MONOTONIC, &s);
+            for (r = 0; r < ROUNDS; r++) {
+                if (i == 0) {
+                    cnt = count_strpbrk(buf, len);
+                } else if (i == 1) {
+                    cnt = count_memchr(buf, len);
+                } else {
+                    cnt = count_nlscan(scan, buf, len);
+                }
+                if (cnt != lines) {
+                    (void) fprintf(stderr, "%s:%s:count mismatch %zu != %zu\n",
+                                    dists[k].name, name, cnt, lines);
+                    return (EXIT_FAILURE);
+                }
+            }
+            (void) clock_gettime(CLOCK_MONOTONIC, &e);
+            ns = elapsed_ns(&s, &e);
+            (void) printf("%-6s %-14s %10.2f %10.2f\n", dists[k].name, name,
+                            ns / ((double) lines * ROUNDS), (double) len * ROUNDS / ns);
+        }
+    }
+    free(buf);
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,193 @@
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server.h"
+#include "framer.h"
+#include "outq.h"
+#include "slab.h"
+
+/* 一度に押し寄せる接続数 */
+#define STORM 1000
+/* 接続の波の回数（最初の1回は暖機として数えない） */
+#define ROUNDS 200
+/* 長い行を受信して受信バッファを広げる接続の割合(%) */
+#define GROW_PCT 10
+/* 接続ごとの状態の大きさ（epollエンジンの接続と同程度） */
+#define CONN_SIZE (sizeof(struct framer) + sizeof(struct outq) + 64)
+
+/* 確保の方法 */
+struct allocator {
+    const char *name;
+    void *(*zalloc)(size_t size);
+    void *(*realloc)(void *p, size_t old, size_t size);
+    void (*free)(void *p, size_t size);
+    unsigned long calls;    // mallocやOSからの確保を呼んだ回数
+};
+
+/* 接続1つ分の確保 */
+struct fake_conn {
+    void *state;
+    char *buf;
+    size_t size;
+};
+
+/* mallocによる確保 */
+static void *
+m_zalloc(size_t size)
+{
+    return (calloc(1, size));
+}
+
+static void *
+m_realloc(void *p, size_t old, size_t size)
+{
+    (void) old;
+    return (realloc(p, size));
+}
+
+static void
+m_free(void *p, size_t size)
+{
+    (void) size;
+    free(p);
+}
+
+/* 経過時間（ナノ秒） */
+static double
+elapsed_ns(const struct timespec *s, const struct timespec *e)
+{
+    return ((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+/* 比較用のdouble */
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/* OSやmallocを呼んだ回数 */
+// slabは統計から、mallocは呼んだ回数そのもの
+static unsigned long
+system_calls(const struct allocator *a)
+{
+    struct slab_stats st;
+
+    if (a->zalloc == m_zalloc) {
+        return (a->calls);
+    }
+    slab_stats(&st);
+    return (st.chunks + st.large);
+}
+
+/* 接続の波を繰り返す */
+// 接続ごとに状態と初期サイズの受信バッファを確保し、一部は長い行で
+// 最大長まで広げてから戻し、受け付けた順とは違う順に閉じる
+// 受付（確保）と切断（解放）それぞれ1接続分の時間をlatに入れる
+static void
+churn(struct allocator *a, double *lat, unsigned long *steady)
+{
+    static struct fake_conn conns[STORM];
+    struct fake_conn t;
+    struct timespec s, e;
+    size_t size, cap;
+    int r, i, j, k, n = 0;
+    unsigned long base = 0;
+
+    cap = REQ_MAX_LINE + FRAMER_HDR + 1;
+    srand(1);
+    for (r = 0; r < ROUNDS; r++) {
+        if (r == 1) {
+            base = system_calls(a);
+        }
+        /* 受付 */
+        for (i = 0; i < STORM; i++) {
+            (void) clock_gettime(CLOCK_MONOTONIC, &s);
+            conns[i].state = a->zalloc(CONN_SIZE);
+            conns[i].buf = a->zalloc(REQ_BUF_INIT);
+            conns[i].size = REQ_BUF_INIT;
+            (void) clock_gettime(CLOCK_MONOTONIC, &e);
+            a->calls += 2;
+            if (r > 0) {
+                lat[n++] = elapsed_ns(&s, &e);
+            }
+        }
+        /* 長い行の受信と、暇になったときの縮小 */
+        for (i = 0; i < STORM; i++) {
+            if (rand() % 100 >= GROW_PCT) {
+                continue;
+            }
+            for (size = conns[i].size * 2; conns[i].size < cap; size *= 2) {
+                size = size > cap ? cap : size;
+                conns[i].buf = a->realloc(conns[i].buf, conns[i].size, size);
+                conns[i].size = size;
+                a->calls++;
+            }
+            conns[i].buf = a->realloc(conns[i].buf, conns[i].size, REQ_BUF_INIT);
+            conns[i].size = REQ_BUF_INIT;
+            a->calls++;
+        }
+        /* 切断（順番を入れ替えて） */
+        for (i = STORM - 1; i > 0; i--) {
+            j = rand() % (i + 1);
+            t = conns[i];
+            conns[i] = conns[j];
+            conns[j] = t;
+        }
+        for (k = 0; k < STORM; k++) {
+            (void) clock_gettime(CLOCK_MONOTONIC, &s);
+            a->free(conns[k].buf, conns[k].size);
+            a->free(conns[k].state, CONN_SIZE);
+            (void) clock_gettime(CLOCK_MONOTONIC, &e);
+            if (r > 0) {
+                lat[n++] = elapsed_ns(&s, &e);
+            }
+        }
+    }
+    *steady = system_calls(a) - base;
+}
+
+/* 接続の確保と解放のベンチマーク */
+// 接続がまとめて押し寄せては閉じられるのを繰り返し、
+// mallocとスレッドごとのslabで1接続分の確保・解放の時間と、
+// 暖機後にmallocやOSからの確保を呼んだ回数を比べる
+int
+main(void)
+{
+    static struct allocator allocs[] = {
+        {"malloc", m_zalloc, m_realloc, m_free, 0},
+        {"slab", slab_zalloc, slab_realloc, slab_free, 0},
+    };
+    unsigned long steady;
+    size_t i, k, n, conns;
+    double *lat, sum;
+
+    n = (size_t) STORM * (ROUNDS - 1) * 2;
+    conns = (size_t) STORM * (ROUNDS - 1);
+    if ((lat = malloc(n * sizeof(*lat))) == NULL) {
+        perror("malloc");
+        return (EXIT_FAILURE);
+    }
+    slab_init(0);
+    (void) printf("%-8s %10s %10s %10s %10s %14s\n",
+                    "alloc", "avg(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)", "sys-allocs/conn");
+    for (i = 0; i < sizeof(allocs) / sizeof(allocs[0]); i++) {
+        churn(&allocs[i], lat, &steady);
+        sum = 0;
+        for (k = 0; k < n; k++) {
+            sum += lat[k];
+        }
+        qsort(lat, n, sizeof(*lat), cmp_double);
+        (void) printf("%-8s %10.0f %10.0f %10.0f %10.0f %14.3f\n", allocs[i].name,
+                        sum / n, lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000],
+                        (double) steady / conns);
+    }
+    free(lat);
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,350 @@
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "shmring.h"
+
+/* 既定の往復回数 */
+#define COUNT 100000
+/* 既定の要求1行の長さ（改行を除く） */
+#define SIZE 32
+/* 計測前に捨てる往復回数 */
+#define WARMUP 1000
+/* 共有メモリのリングで計測する対象の接頭辞（パスはshmエンジンのunix:ソケット） */
+#define SHM_PREFIX "shm:"
+/* サーバーの生存を確かめる間隔（ミリ秒） */
+#define SHM_POLL_MS 100
+
+/* 計測対象との接続 */
+struct conn {
+    int soc;
+    struct shmseg *seg;     // 共有メモリのリングでやりとりするとき
+};
+
+/* 経過時間（ナノ秒） */
+static double
+elapsed_ns(const struct timespec *s, const struct timespec *e)
+{
+    return ((e->tv_sec - s->tv_sec) * 1e9 + (e->tv_nsec - s->tv_nsec));
+}
+
+/* 消費したCPU時間（ユーザーとシステムの合計、ナノ秒） */
+static double
+cpu_ns(void)
+{
+    struct rusage ru;
+
+    (void) getrusage(RUSAGE_SELF, &ru);
+    return ((ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9
+            + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3);
+}
+
+/* 比較用のdouble */
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/* 計測対象への接続 */
+// 「unix:パス」ならUnixドメイン、「ホスト:ポート」ならTCPで接続する
+static int
+connect_socket(const char *target)
+{
+    char host[NI_MAXHOST];
+    struct sockaddr_un addr;
+    struct addrinfo hints, *res0;
+    const char *port;
+    int soc, opt, errcode;
+
+    if (strncmp(target, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+        (void) memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        (void) snprintf(addr.sun_path, sizeof(addr.sun_path), "%s",
+                        target + sizeof(UNIX_PREFIX) - 1);
+        if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            perror("socket");
+            return (-1);
+        }
+        if (connect(soc, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            perror("connect");
+            (void) close(soc);
+            return (-1);
+        }
+        return (soc);
+    }
+    if ((port = strrchr(target, ':')) == NULL
+            || (size_t) (port - target) >= sizeof(host)) {
+        (void) fprintf(stderr, "%s:expected host:port or %spath\n", target, UNIX_PREFIX);
+        return (-1);
+    }
+    (void) snprintf(host, sizeof(host), "%.*s", (int) (port - target), target);
+    (void) memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((errcode = getaddrinfo(host, port + 1, &hints, &res0)) != 0) {
+        (void) fprintf(stderr, "getaddrinfo():%s\n", gai_strerror(errcode));
+        return (-1);
+    }
+    if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
+        perror("socket");
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    if (connect(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
+        perror("connect");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    freeaddrinfo(res0);
+    // 1往復ずつなのでNagleで待たされないようにする
+    opt = 1;
+    (void) setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return (soc);
+}
+
+/* 計測対象との接続（共有メモリを含む） */
+// 「shm:パス」ならそのUnixドメインソケットで受け取ったセグメントのリングを使う
+// 0:成功 -1:エラー
+static int
+connect_target(const char *target, struct conn *c)
+{
+    char path[sizeof(UNIX_PREFIX) + PATH_MAX];
+
+    c->seg = NULL;
+    if (strncmp(target, SHM_PREFIX, sizeof(SHM_PREFIX) - 1) != 0) {
+        return ((c->soc = connect_socket(target)) == -1 ? -1 : 0);
+    }
+    (void) snprintf(path, sizeof(path), "%s%s", UNIX_PREFIX, target + sizeof(SHM_PREFIX) - 1);
+    if ((c->soc = connect_socket(path)) == -1) {
+        return (-1);
+    }
+    if ((c->seg = shmseg_connect(c->soc)) == NULL) {
+        (void) close(c->soc);
+        return (-1);
+    }
+    return (0);
+}
+
+/* 計測対象との切断 */
+// 共有メモリなら要求のリングを閉じてサーバーに終わりを伝える
+static void
+close_target(struct conn *c)
+{
+    if (c->seg != NULL) {
+        shmring_close(&c->seg->req);
+        shmseg_unmap(c->seg);
+    }
+    (void) close(c->soc);
+}
+
+/* 共有メモリのリングでの1往復 */
+// 0:成功 -1:エラー
+static int
+shm_round_trip(struct conn *c, const char *req, size_t len, char *resp, size_t rlen)
+{
+    size_t got;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = shmring_write(&c->seg->req, req, len)) == -1) {
+            (void) fprintf(stderr, "shm:broken ring\n");
+            return (-1);
+        }
+        if (n == 0) {
+            if (shmring_closed(&c->seg->req)
+                    || (!shmring_wait_space(&c->seg->req, SHM_POLL_MS)
+                        && shmseg_peer_gone(c->soc))) {
+                (void) fprintf(stderr, "shm:closed\n");
+                return (-1);
+            }
+        }
+        req += n;
+        len -= (size_t) n;
+    }
+    for (got = 0; got < rlen; got += (size_t) n) {
+        if ((n = shmring_read(&c->seg->resp, resp + got, rlen - got)) == -1) {
+            (void) fprintf(stderr, "shm:broken ring\n");
+            return (-1);
+        }
+        if (n == 0) {
+            if (shmring_closed(&c->seg->resp)
+                    || (!shmring_wait_data(&c->seg->resp, SHM_POLL_MS)
+                        && shmseg_peer_gone(c->soc))) {
+                (void) fprintf(stderr, "shm:EOF\n");
+                return (-1);
+            }
+        }
+    }
+    return (0);
+}
+
+/* 1往復（要求1行を送り、応答を全部受け取る） */
+// 0:成功 -1:エラー
+static int
+round_trip(struct conn *c, const char *req, size_t len, char *resp, size_t rlen)
+{
+    size_t got;
+    ssize_t n;
+    int soc = c->soc;
+
+    if (c->seg != NULL) {
+        return (shm_round_trip(c, req, len, resp, rlen));
+    }
+    if (send(soc, req, len, MSG_NOSIGNAL) != (ssize_t) len) {
+        perror("send");
+        return (-1);
+    }
+    for (got = 0; got < rlen; got += (size_t) n) {
+        if ((n = recv(soc, resp + got, rlen - got, 0)) <= 0) {
+            if (n == -1) {
+                perror("recv");
+            } else {
+                (void) fprintf(stderr, "recv:EOF\n");
+            }
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/* 往復の繰り返し */
+// lat[i]にi回目の往復の遅延を入れる
+// churnが真なら毎回接続し直し、接続と切断も含めた時間を測る
+// 0:成功 -1:エラー
+static int
+measure(const char *target, int churn, const char *req, size_t len,
+        char *resp, size_t rlen, double *lat, int count)
+{
+    struct timespec s, e;
+    struct conn c;
+    int i, ret;
+
+    for (i = -WARMUP; i < count; i++) {
+        (void) clock_gettime(CLOCK_MONOTONIC, &s);
+        if ((i == -WARMUP || churn) && connect_target(target, &c) == -1) {
+            return (-1);
+        }
+        ret = round_trip(&c, req, len, resp, rlen);
+        if (ret == -1 || churn || i == count - 1) {
+            close_target(&c);
+        }
+        if (ret == -1) {
+            return (-1);
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &e);
+        if (i >= 0) {
+            lat[i] = elapsed_ns(&s, &e);
+        }
+    }
+    return (0);
+}
+
+/* 1つの計測対象について往復の遅延を測る */
+// 0:成功 -1:エラー
+static int
+bench_target(const char *target, int churn, int count, size_t size)
+{
+    struct timespec t0, t1;
+    double *lat, cpu, sum;
+    char *req, *resp;
+    size_t rlen;
+    int i, ret = -1;
+
+    rlen = size + sizeof(RESP_SUFFIX) - 1;
+    req = malloc(size + 1);
+    resp = malloc(rlen);
+    lat = malloc(sizeof(*lat) * (size_t) count);
+    if (req == NULL || resp == NULL || lat == NULL) {
+        perror("malloc");
+    } else {
+        (void) memset(req, 'x', size);
+        req[size] = '\n';
+        cpu = cpu_ns();
+        (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+        ret = measure(target, churn, req, size + 1, resp, rlen, lat, count);
+        (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+        cpu = cpu_ns() - cpu;
+        if (ret == 0) {
+            sum = 0;
+            for (i = 0; i < count; i++) {
+                sum += lat[i];
+            }
+            qsort(lat, (size_t) count, sizeof(*lat), cmp_double);
+            // CPU時間と毎秒の往復回数は暖機の分も含めて割る
+            (void) printf("%-28s %10.0f %10.0f %10.0f %10.0f %12.0f\n", target,
+                            sum / count, lat[count / 2], lat[count * 99 / 100],
+                            cpu / (count + WARMUP),
+                            (count + WARMUP) / (elapsed_ns(&t0, &t1) / 1e9));
+        }
+    }
+    free(lat);
+    free(resp);
+    free(req);
+    return (ret);
+}
+
+/* 経路ごとの往復遅延のベンチマーク */
+// 起動済みのサーバーへ1行ずつ送って応答を待つのを繰り返し、
+// TCPのループバック、Unixドメインソケット、共有メモリのリングの遅延と
+// クライアント側のCPU時間を比べる
+// 例: ./server -e epoll 5000 & ./server -e epoll unix:/tmp/s.sock &
+//     ./server -e shm unix:/tmp/m.sock &
+//     ./bench_transport 127.0.0.1:5000 unix:/tmp/s.sock shm:/tmp/m.sock
+// -c で1往復ごとに接続し直し、接続の受付と切断が続くときの遅延を測る
+int
+main(int argc, char *argv[])
+{
+    size_t size = SIZE;
+    int ch, i, churn = 0, count = COUNT, ret = EX_OK;
+
+    while ((ch = getopt(argc, argv, "cn:s:")) != -1) {
+        switch (ch) {
+        case 'c':
+            churn = 1;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            size = (size_t) atol(optarg);
+            break;
+        default:
+            count = 0;
+            break;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc <= 0 || count <= 0) {
+        (void) fprintf(stderr, "bench_transport [-c] [-n count] [-s size] host:port|unix:path|shm:path ...\n");
+        return (EX_USAGE);
+    }
+    (void) printf("%-28s %10s %10s %10s %10s %12s\n",
+                    "target", "avg(ns)", "p50(ns)", "p99(ns)", "cpu(ns)", "req/s");
+    for (i = 0; i < argc; i++) {
+        if (bench_target(argv[i], churn, count, size) == -1) {
+            ret = EX_UNAVAILABLE;
+        }
+    }
+    return (ret);
+}
@@ -1,6 +1,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -16,7 +17,41 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+/* この接頭辞で始まるアドレスはUnixドメインソケットのパス */
+#define UNIX_PREFIX "unix:"
+
+/* Unixドメインソケットでサーバーに接続 */
+// 同じホストのサーバーならTCP/IPのスタックを通らずに済む
+static int
+unix_client_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int soc;
+
+    (void) memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        (void) fprintf(stderr, "%s%s:path too long\n", UNIX_PREFIX, path);
+        return (-1);
+    }
+    (void) strcpy(addr.sun_path, path);
+    (void) fprintf(stderr, "path=%s\n", path);
+    /* ソケットの生成 */
+    if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    /* コネクト */
+    if (connect(soc, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
 /* サーバーにソケット接続 */
+// hostnmが「unix:パス」ならUnixドメインソケットで接続する（portnmは使わない）
 int
 client_socket(const char *hostnm, const char *portnm)
 {
@@ -24,6 +59,10 @@ client_socket(const char *hostnm, const char *portnm)
     struct addrinfo hints, *res0;
     int soc, errcode;
 
+    if (strncmp(hostnm, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+        return (unix_client_socket(hostnm + sizeof(UNIX_PREFIX) - 1));
+    }
+
     /* アドレス情報のヒントをゼロクリア */
     (void) memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -151,12 +190,13 @@ main(int argc, char *argv[])
 {
     int soc;
     /* 引数にホスト名、ポート番号が指定されているか？ */
-    if (argc <= 2) {
-        (void) fprintf(stderr, "client server-host port\n");
+    // Unixドメインソケットならパスだけでよい
+    if (argc <= 2 && (argc <= 1 || strncmp(argv[1], UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) != 0)) {
+        (void) fprintf(stderr, "client server-host port | client unix:path\n");
         return (EX_USAGE);
     }
     /* サーバーにソケット接続 */
-    if ((soc = client_socket(argv[1], argv[2])) == -1) {
+    if ((soc = client_socket(argv[1], argc > 2 ? argv[2] : NULL)) == -1) {
         (void) fprintf(stderr, "client_socket():err\n");
         return (EX_UNAVAILABLE);
     }
@@ -0,0 +1,256 @@
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framer.h"
+#include "nlscan.h"
+#include "slab.h"
+
+/* フレーマーの初期化 */
+// sizeバイトのバッファを確保し、行やフレームが収まらなければ広げる
+// 上限はmax_lineの行と改行、またはmax_lineのフレームとヘッダが収まる大きさ
+// 0:成功 -1:エラー
+int
+framer_init(struct framer *f, size_t size, size_t max_line)
+{
+    f->cap = max_line + FRAMER_HDR + 1;
+    if (size > f->cap) {
+        size = f->cap;
+    }
+    if ((f->buf = slab_alloc(size)) == NULL) {
+        perror("slab_alloc");
+        return (-1);
+    }
+    f->size = f->init = size;
+    f->max_line = max_line;
+    f->mode = FRAMER_UNKNOWN;
+    f->bad = 0;
+    f->start = f->scan = f->end = 0;
+    f->nl_head = f->nl_cnt = 0;
+    f->eof = 0;
+    f->held = 0;
+    return (0);
+}
+
+/* フレーマーの解放 */
+void
+framer_free(struct framer *f)
+{
+    slab_free(f->buf, f->size);
+    f->buf = NULL;
+}
+
+/* 受信先の空き領域 */
+// 処理済みの分を前に詰めてから空きを返す
+// 詰めても空きがなければ、max_lineより長い行が収まるまでバッファを倍にする
+// 保持中は詰めずに末尾の空きだけを返す（0なら解放を待つ）
+// NULL:広げられなかったか、長すぎるフレームを受信したので接続を閉じる
+char *
+framer_space(struct framer *f, size_t *avail)
+{
+    size_t size;
+    char *p;
+    int i;
+
+    if (f->bad) {
+        *avail = 0;
+        return (NULL);
+    }
+    if (f->start > 0 && !f->held) {
+        if (f->start < f->end) {
+            (void) memmove(f->buf, f->buf + f->start, f->end - f->start);
+        }
+        for (i = f->nl_head; i < f->nl_head + f->nl_cnt; i++) {
+            f->nl[i] -= (unsigned) f->start;
+        }
+        f->end -= f->start;
+        f->scan -= f->start;
+        f->start = 0;
+    }
+    if (f->end == f->size && !f->held && f->size < f->cap) {
+        // 詰めた後なので、広げても未処理の改行位置はそのまま使える
+        size = f->size * 2 > f->cap ? f->cap : f->size * 2;
+        if ((p = slab_realloc(f->buf, f->size, size)) == NULL) {
+            perror("slab_realloc");
+            *avail = 0;
+            return (NULL);
+        }
+        f->buf = p;
+        f->size = size;
+    }
+    *avail = f->size - f->end;
+    return (f->buf + f->end);
+}
+
+/* バッファを初期サイズに戻す */
+// 未処理のデータがなく、送信待ちも参照していないときだけ縮める
+// 接続が暇になったところで呼ぶ
+void
+framer_shrink(struct framer *f)
+{
+    char *p;
+
+    if (f->size == f->init || f->held || f->start != f->end) {
+        return;
+    }
+    if ((p = slab_realloc(f->buf, f->size, f->init)) == NULL) {
+        // 縮められなくてもそのまま使える
+        return;
+    }
+    f->buf = p;
+    f->size = f->init;
+    f->start = f->scan = f->end = 0;
+}
+
+/* 受信したバイト数の反映 */
+void
+framer_commit(struct framer *f, size_t n)
+{
+    f->end += n;
+}
+
+/* 受信終了の反映 */
+// 改行で終わっていない最後の行も取り出せるようにする
+void
+framer_eof(struct framer *f)
+{
+    f->eof = 1;
+}
+
+/* 処理済みの行の保持 */
+// framer_nextで取り出した行を応答のiovecが直接参照している間、
+// 受信データを詰めて上書きしないようにする
+void
+framer_hold(struct framer *f)
+{
+    f->held = 1;
+}
+
+/* 処理済みの行の解放 */
+// 参照していた応答を送り終えたら呼ぶ
+void
+framer_release(struct framer *f)
+{
+    f->held = 0;
+}
+
+/* フレームのペイロード長 */
+static size_t
+framer_frame_len(const struct framer *f)
+{
+    uint32_t n;
+
+    (void) memcpy(&n, f->buf + f->start, sizeof(n));
+    return ((size_t) ntohl(n));
+}
+
+/* フレームの検索 */
+// ヘッダとペイロードがすべて届いていれば1を返す
+// 改行を探す必要はなく、長さだけで区切れる
+static int
+framer_scan_frame(struct framer *f)
+{
+    size_t n;
+
+    if (f->bad || f->end - f->start < FRAMER_HDR) {
+        return (0);
+    }
+    if ((n = framer_frame_len(f)) > f->max_line) {
+        // 区切ると応答の長さと合わなくなるので受け付けない
+        (void) fprintf(stderr, "frame too long:%zu\n", n);
+        f->bad = 1;
+        return (0);
+    }
+    return (f->end - f->start - FRAMER_HDR >= n);
+}
+
+/* 区切りの検索 */
+// 未処理の改行位置がなくなったら、続きの受信データからまとめて見つけておく
+// 取り出せる行があれば1を返す
+static int
+framer_scan(struct framer *f)
+{
+    size_t n;
+
+    /* 形式の判定 */
+    if (f->mode == FRAMER_UNKNOWN) {
+        if (f->end == f->start) {
+            return (0);
+        }
+        if ((unsigned char) f->buf[f->start] == FRAMER_MAGIC) {
+            f->mode = FRAMER_BINARY;
+            f->scan = ++f->start;
+        } else {
+            f->mode = FRAMER_TEXT;
+        }
+    }
+    if (f->mode == FRAMER_BINARY) {
+        return (framer_scan_frame(f));
+    }
+
+    if (f->nl_cnt == 0 && f->scan < f->end) {
+        n = nlscan(f->buf, f->scan, f->end, f->nl, FRAMER_NL);
+        f->nl_head = 0;
+        f->nl_cnt = (int) n;
+        // 一杯になったら最後の改行の次から続きを探す
+        f->scan = n == FRAMER_NL ? f->nl[n - 1] + 1 : f->end;
+    }
+    if (f->nl_cnt > 0) {
+        return (1);
+    }
+    // 長すぎる行はmax_lineで区切る
+    // ちょうどmax_lineの行は改行が届くまで待つ
+    return (f->end - f->start > f->max_line || (f->eof && f->end > f->start));
+}
+
+/* 取り出せる行があるか */
+int
+framer_ready(struct framer *f)
+{
+    return (framer_scan(f));
+}
+
+/* 1行の取り出し */
+// lineには改行(\r\n or \n)を除いた行の先頭、lenにその長さが入る
+// バイナリフレームならlineはヘッダの直後のペイロードを指す
+// lineは次にframer_spaceを呼ぶまで（保持中は解放するまで）有効
+int
+framer_next(struct framer *f, const char **line, size_t *len)
+{
+    size_t n;
+
+    if (!framer_scan(f)) {
+        return (0);
+    }
+    *line = f->buf + f->start;
+    if (f->mode == FRAMER_BINARY) {
+        /* 長さヘッダ付きのフレーム */
+        n = framer_frame_len(f);
+        *line += FRAMER_HDR;
+        f->start += FRAMER_HDR + n;
+        f->scan = f->start;
+    } else if (f->nl_cnt > 0 && f->nl[f->nl_head] - f->start <= f->max_line) {
+        /* 改行で区切られた行 */
+        n = f->nl[f->nl_head] - f->start;
+        f->start = f->nl[f->nl_head] + 1;
+        f->nl_head++;
+        f->nl_cnt--;
+        if (n > 0 && (*line)[n - 1] == '\r') {
+            n--;
+        }
+    } else {
+        /* 長すぎる行か、受信終了時の改行のない行 */
+        n = f->end - f->start;
+        if (n > f->max_line) {
+            n = f->max_line;
+        }
+        f->start += n;
+    }
+    *len = n;
+    return (1);
+}
@@ -0,0 +1,56 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <sys/types.h>
+
+/* 一度に見つけておく改行位置の数 */
+#define FRAMER_NL 64
+/* 接続の最初の1バイトがこれならバイナリフレームとして扱う */
+#define FRAMER_MAGIC 0xB1
+/* バイナリフレームのヘッダ（ペイロード長、4バイトのビッグエンディアン）の長さ */
+#define FRAMER_HDR 4
+
+/* 受信データの形式 */
+enum framer_mode {
+    FRAMER_UNKNOWN,     // 最初の1バイトを受信するまで
+    FRAMER_TEXT,        // 改行で区切られた行
+    FRAMER_BINARY,      // 長さヘッダ付きのフレーム
+};
+
+/* 行単位の逐次フレーマー */
+// 受信データを溜めておき、改行で区切られた要求を1つずつ取り出す
+// 区切りは'\n'だけで、直前の'\r'は取り除く（"\r\n"と"\n"の行）
+// 単独の'\r'は区切りではなく行の一部になる（strpbrk(buf, "\r\n")で区切っていた当初とは異なる）
+// 行の途中で受信が切れても次の受信とつなげて扱う
+// 最初の1バイトがFRAMER_MAGICなら、以降は長さヘッダ付きのフレームを1つずつ取り出す
+// バッファは小さく始め、行が収まらなければ倍々に広げ、空いたら元に戻す
+struct framer {
+    char *buf;
+    size_t size;        // bufの現在のサイズ
+    size_t init;        // bufの初期サイズ（縮めるときはここまで）
+    size_t cap;         // bufを広げる上限
+    size_t max_line;    // これより長い行は途中で区切る（フレームはエラー）
+    enum framer_mode mode;
+    int bad;            // 長すぎるフレームを受信したので以降は読まない
+    size_t start;       // 未処理データの先頭
+    size_t scan;        // 区切りを探し終えた位置
+    unsigned nl[FRAMER_NL];     // scanまでに見つけた未処理の改行位置
+    int nl_head, nl_cnt;        // nl[nl_head]からnl_cnt個が未処理
+    size_t end;         // 受信済みデータの末尾
+    int eof;            // 相手が送信を終えたので残りも1行として扱う
+    int held;           // 処理済みの行を送信待ちが参照しているので詰めない
+};
+
+/* framer.c */
+int framer_init(struct framer *f, size_t size, size_t max_line);
+void framer_free(struct framer *f);
+char *framer_space(struct framer *f, size_t *avail);
+void framer_shrink(struct framer *f);
+void framer_commit(struct framer *f, size_t n);
+void framer_eof(struct framer *f);
+void framer_hold(struct framer *f);
+void framer_release(struct framer *f);
+int framer_ready(struct framer *f);
+int framer_next(struct framer *f, const char **line, size_t *len);
+
+#endif
@@ -0,0 +1,674 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* 書き出しスレッドがまとめてwriteする大きさ */
+#define LOG_OUT_SIZE (64 * 1024)
+/* 折り返しの詰め物を表すレベル */
+#define LOG_PAD UINT32_MAX
+
+/* 1件の見出し */
+// 続けて書式の引数を置く（整数・ポインタ・浮動小数点数は8バイト、
+// 文字列は4バイトの長さと中身を8バイト境界まで）
+struct log_rec {
+    uint32_t size;      // 見出しを含めた大きさ（8バイトの倍数）
+    uint32_t level;     // LOG_PADなら中身のない詰め物
+    const char *fmt;    // 書式（文字列リテラルなので書き出しまで残っている）
+};
+
+/* スレッドごとのリング */
+// 生産者はそのスレッドだけ、消費者は書き出しスレッドだけなのでロックはいらない
+struct log_ring {
+    struct log_ring *next;
+    int dead;                   // スレッドが終了したので空になったら解放する
+    unsigned long dropped;      // 入りきらずに捨てた件数
+    unsigned long reported;     // 書き出しスレッドが報告済みの件数
+    // 生産者と消費者が触る変数はキャッシュラインを分ける
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t head __attribute__((aligned(64)));
+    char data[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* 変換指定を分解したもの */
+struct log_spec {
+    char flags[8];
+    int nflags;
+    int width, wstar;   // 幅（-1なら指定なし）と*で引数から取るか
+    int prec, pstar;    // 精度（-1なら指定なし）と*で引数から取るか
+    char len[3];        // 長さ修飾子
+    char conv;          // 変換文字（0なら扱えない指定）
+};
+
+/* 現在のログレベル */
+int g_log_level = LOG_LEVEL_DEBUG;
+
+/* 書き出しスレッドとリングの一覧 */
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+    struct log_ring *rings;
+    int running;        // 書き出しスレッドが動いている
+    int restart;        // fork後の最初の出力で書き出しスレッドを作り直す
+    pthread_key_t key;  // スレッド終了時にリングを手放すため
+} g_log = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0};
+
+static __thread struct log_ring *tl_ring;
+
+static int log_start(void);
+
+/* レベル名の解析 */
+// -1:不明な名前
+int
+log_level_parse(const char *name)
+{
+    static const char *names[] = {"err", "info", "debug"};
+    int i;
+
+    for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* 変換指定の分解 */
+// pは%の次を指し、変換文字の次を返す
+static const char *
+log_spec_parse(const char *p, struct log_spec *sp)
+{
+    int n = 0;
+
+    (void) memset(sp, 0, sizeof(*sp));
+    sp->width = sp->prec = -1;
+    while (strchr("-+ #0", *p) != NULL && *p != '\0' && sp->nflags < (int) sizeof(sp->flags) - 1) {
+        sp->flags[sp->nflags++] = *p++;
+    }
+    if (*p == '*') {
+        sp->wstar = 1;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        for (sp->width = 0; *p >= '0' && *p <= '9'; p++) {
+            sp->width = sp->width * 10 + (*p - '0');
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            sp->pstar = 1;
+            p++;
+        } else {
+            for (sp->prec = 0; *p >= '0' && *p <= '9'; p++) {
+                sp->prec = sp->prec * 10 + (*p - '0');
+            }
+        }
+    }
+    while (strchr("hljztL", *p) != NULL && *p != '\0' && n < (int) sizeof(sp->len) - 1) {
+        sp->len[n++] = *p++;
+    }
+    if (*p != '\0' && strchr("diouxXcspeEfFgGaA%", *p) != NULL) {
+        sp->conv = *p++;
+    }
+    return (p);
+}
+
+/* 整数の変換か */
+static int
+log_conv_int(char conv)
+{
+    return (conv != '\0' && strchr("diouxX", conv) != NULL);
+}
+
+/* 符号付き整数の引数の取り出し */
+static int64_t
+log_arg_signed(const struct log_spec *sp, va_list *ap)
+{
+    if (strcmp(sp->len, "hh") == 0) {
+        return ((signed char) va_arg(*ap, int));
+    } else if (strcmp(sp->len, "h") == 0) {
+        return ((short) va_arg(*ap, int));
+    } else if (strcmp(sp->len, "l") == 0) {
+        return (va_arg(*ap, long));
+    } else if (strcmp(sp->len, "ll") == 0 || strcmp(sp->len, "j") == 0) {
+        return (va_arg(*ap, long long));
+    } else if (strcmp(sp->len, "z") == 0) {
+        return (va_arg(*ap, ssize_t));
+    } else if (strcmp(sp->len, "t") == 0) {
+        return (va_arg(*ap, ptrdiff_t));
+    }
+    return (va_arg(*ap, int));
+}
+
+/* 符号なし整数の引数の取り出し */
+static uint64_t
+log_arg_unsigned(const struct log_spec *sp, va_list *ap)
+{
+    if (strcmp(sp->len, "hh") == 0) {
+        return ((unsigned char) va_arg(*ap, unsigned));
+    } else if (strcmp(sp->len, "h") == 0) {
+        return ((unsigned short) va_arg(*ap, unsigned));
+    } else if (strcmp(sp->len, "l") == 0) {
+        return (va_arg(*ap, unsigned long));
+    } else if (strcmp(sp->len, "ll") == 0 || strcmp(sp->len, "j") == 0) {
+        return (va_arg(*ap, unsigned long long));
+    } else if (strcmp(sp->len, "z") == 0) {
+        return (va_arg(*ap, size_t));
+    } else if (strcmp(sp->len, "t") == 0) {
+        return ((uint64_t) va_arg(*ap, ptrdiff_t));
+    }
+    return (va_arg(*ap, unsigned));
+}
+
+/* 引数の詰め込み */
+// 書式を変換せずに、引数の値と文字列の中身だけをbufへコピーする
+// 返り値はレコードの大きさ
+static size_t
+log_encode(char *buf, size_t max, int level, const char *fmt, va_list ap)
+{
+    struct log_rec *rec = (struct log_rec *) buf;
+    struct log_spec sp;
+    const char *p, *s;
+    size_t off = sizeof(*rec), n;
+    uint64_t v;
+    uint32_t len;
+    va_list aq;
+    double d;
+    int i;
+
+    // 取り出し用の関数にva_listのアドレスを渡すので複製して使う
+    va_copy(aq, ap);
+    rec->level = (uint32_t) level;
+    rec->fmt = fmt;
+    for (p = fmt; (p = strchr(p, '%')) != NULL; ) {
+        p = log_spec_parse(p + 1, &sp);
+        if (sp.conv == '\0') {
+            // 型が分からない指定より後ろの引数は読まない
+            break;
+        }
+        if (sp.conv == '%') {
+            continue;
+        }
+        if (off + 3 * sizeof(v) > max) {
+            break;
+        }
+        if (sp.wstar) {
+            v = (uint64_t) (int64_t) va_arg(aq, int);
+            (void) memcpy(buf + off, &v, sizeof(v));
+            off += sizeof(v);
+        }
+        if (sp.pstar) {
+            i = va_arg(aq, int);
+            v = (uint64_t) (int64_t) i;
+            (void) memcpy(buf + off, &v, sizeof(v));
+            off += sizeof(v);
+            sp.prec = i;
+        }
+        switch (sp.conv) {
+        case 'd':
+        case 'i':
+            v = (uint64_t) log_arg_signed(&sp, &aq);
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            v = log_arg_unsigned(&sp, &aq);
+            break;
+        case 'c':
+            v = (uint64_t) va_arg(aq, int);
+            break;
+        case 'p':
+            v = (uint64_t) (uintptr_t) va_arg(aq, void *);
+            break;
+        case 's':
+            if ((s = va_arg(aq, const char *)) == NULL) {
+                s = "(null)";
+            }
+            n = sp.prec >= 0 ? strnlen(s, (size_t) sp.prec) : strlen(s);
+            // 入りきらない分は切り詰める
+            if (n > max - off - sizeof(len)) {
+                n = max - off - sizeof(len);
+            }
+            len = (uint32_t) n;
+            (void) memcpy(buf + off, &len, sizeof(len));
+            (void) memcpy(buf + off + sizeof(len), s, n);
+            off = (off + sizeof(len) + n + 7) & ~(size_t) 7;
+            continue;
+        default:
+            if (strcmp(sp.len, "L") == 0) {
+                d = (double) va_arg(aq, long double);
+            } else {
+                d = va_arg(aq, double);
+            }
+            (void) memcpy(&v, &d, sizeof(v));
+            break;
+        }
+        (void) memcpy(buf + off, &v, sizeof(v));
+        off += sizeof(v);
+    }
+    va_end(aq);
+    rec->size = (uint32_t) off;
+    return (off);
+}
+
+/* 1件の書式変換 */
+// 詰め込んだ引数で書式を変換してlineに書き、長さを返す（maxを超える分は捨てる）
+static size_t
+log_format(const struct log_rec *rec, char *line, size_t max)
+{
+    const char *args = (const char *) (rec + 1), *end = (const char *) rec + rec->size;
+    const char *p, *q;
+    struct log_spec sp;
+    char spec[32];
+    size_t pos = 0, n, k;
+    uint64_t v;
+    uint32_t len;
+    double d;
+    int w;
+
+    for (p = rec->fmt; *p != '\0' && pos < max; p = q) {
+        if (*p != '%') {
+            // 次の変換指定までをそのままコピー
+            if ((q = strchr(p, '%')) == NULL) {
+                q = p + strlen(p);
+            }
+            n = (size_t) (q - p) < max - pos ? (size_t) (q - p) : max - pos;
+            (void) memcpy(line + pos, p, n);
+            pos += n;
+            continue;
+        }
+        q = log_spec_parse(p + 1, &sp);
+        if (sp.conv == '\0') {
+            // 扱えない指定から後ろはそのまま出す
+            n = strlen(p) < max - pos ? strlen(p) : max - pos;
+            (void) memcpy(line + pos, p, n);
+            pos += n;
+            break;
+        }
+        if (sp.conv == '%') {
+            line[pos++] = '%';
+            continue;
+        }
+        // 引数から取る幅・精度は数字に置き換えた変換指定を作り直す
+        if (sp.wstar && args + sizeof(v) <= end) {
+            (void) memcpy(&v, args, sizeof(v));
+            args += sizeof(v);
+            if ((w = (int) (int64_t) v) < 0) {
+                sp.flags[sp.nflags++] = '-';
+                w = -w;
+            }
+            sp.width = w;
+        }
+        if (sp.pstar && args + sizeof(v) <= end) {
+            (void) memcpy(&v, args, sizeof(v));
+            args += sizeof(v);
+            sp.prec = (int) (int64_t) v;
+        }
+        k = (size_t) snprintf(spec, sizeof(spec), "%%%.*s", sp.nflags, sp.flags);
+        if (sp.width >= 0) {
+            k += (size_t) snprintf(spec + k, sizeof(spec) - k, "%d", sp.width);
+        }
+        if (sp.conv == 's') {
+            // 精度は詰め込むときに適用済み
+            (void) snprintf(spec + k, sizeof(spec) - k, ".*s");
+            if (args + sizeof(len) > end) {
+                break;
+            }
+            (void) memcpy(&len, args, sizeof(len));
+            n = (size_t) snprintf(line + pos, max - pos + 1, spec, (int) len, args + sizeof(len));
+            args += (sizeof(len) + len + 7) & ~(size_t) 7;
+        } else {
+            if (sp.prec >= 0) {
+                k += (size_t) snprintf(spec + k, sizeof(spec) - k, ".%d", sp.prec);
+            }
+            (void) snprintf(spec + k, sizeof(spec) - k, "%s%c",
+                            log_conv_int(sp.conv) ? "ll" : "", sp.conv);
+            if (args + sizeof(v) > end) {
+                break;
+            }
+            (void) memcpy(&v, args, sizeof(v));
+            args += sizeof(v);
+            if (sp.conv == 'd' || sp.conv == 'i') {
+                n = (size_t) snprintf(line + pos, max - pos + 1, spec, (long long) v);
+            } else if (log_conv_int(sp.conv)) {
+                n = (size_t) snprintf(line + pos, max - pos + 1, spec, (unsigned long long) v);
+            } else if (sp.conv == 'c') {
+                n = (size_t) snprintf(line + pos, max - pos + 1, spec, (int) v);
+            } else if (sp.conv == 'p') {
+                n = (size_t) snprintf(line + pos, max - pos + 1, spec, (void *) (uintptr_t) v);
+            } else {
+                (void) memcpy(&d, &v, sizeof(d));
+                n = (size_t) snprintf(line + pos, max - pos + 1, spec, d);
+            }
+        }
+        pos += n < max - pos ? n : max - pos;
+    }
+    return (pos);
+}
+
+/* すべて書き出す */
+static void
+log_out(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(STDERR_FILENO, buf, len)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+}
+
+/* リングからの書き出し */
+// 溜まっているレコードを変換してoutに溜め、一杯になるたびにwriteする
+// 返り値は取り出した件数
+static unsigned long
+log_drain_ring(struct log_ring *r, char *out, size_t *outlen)
+{
+    struct log_rec *rec;
+    unsigned long dropped, n = 0;
+    uint32_t head, tail;
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        rec = (struct log_rec *) (r->data + (head & (LOG_RING_SIZE - 1)));
+        if (rec->level != LOG_PAD) {
+            if (LOG_OUT_SIZE - *outlen < LOG_REC_MAX * 2) {
+                log_out(out, *outlen);
+                *outlen = 0;
+            }
+            *outlen += log_format(rec, out + *outlen, LOG_REC_MAX * 2 - 1);
+            n++;
+        }
+        head += rec->size;
+    }
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    if ((dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED)) != r->reported) {
+        if (LOG_OUT_SIZE - *outlen < LOG_REC_MAX * 2) {
+            log_out(out, *outlen);
+            *outlen = 0;
+        }
+        *outlen += (size_t) snprintf(out + *outlen, LOG_OUT_SIZE - *outlen,
+                                        "log:%lu messages dropped\n", dropped - r->reported);
+        r->reported = dropped;
+    }
+    return (n);
+}
+
+/* すべてのリングからの書き出し */
+// g_log.muを持って呼ぶ
+// 終了したスレッドのリングは空にしてから解放する
+static void
+log_drain_locked(void)
+{
+    static char out[LOG_OUT_SIZE];
+    struct log_ring **pp, *r;
+    size_t outlen = 0;
+
+    for (pp = &g_log.rings; (r = *pp) != NULL; ) {
+        (void) log_drain_ring(r, out, &outlen);
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE)
+                && r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+            *pp = r->next;
+            (void) munmap(r, sizeof(*r));
+            continue;
+        }
+        pp = &r->next;
+    }
+    log_out(out, outlen);
+}
+
+/* 書き出しスレッド */
+// LOG_FLUSH_MSごとに、またはリングが半分埋まって起こされたらまとめて書き出す
+static void *
+log_writer(void *arg)
+{
+    struct timespec ts;
+
+    (void) arg;
+    (void) pthread_mutex_lock(&g_log.mu);
+    for (;;) {
+        log_drain_locked();
+        (void) clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long) LOG_FLUSH_MS * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        (void) pthread_cond_timedwait(&g_log.cond, &g_log.mu, &ts);
+    }
+    return (NULL);
+}
+
+/* スレッド終了時のリングの後始末 */
+// 書き出しスレッドが残りを書き出してから解放する
+static void
+log_thread_exit(void *arg)
+{
+    struct log_ring *r = arg;
+
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+/* 呼び出したスレッドのリング */
+// 最初の出力のときに作って一覧に加える
+static struct log_ring *
+log_ring_get(void)
+{
+    struct log_ring *r;
+
+    if ((r = tl_ring) != NULL) {
+        return (r);
+    }
+    if ((r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        return (NULL);
+    }
+    (void) pthread_mutex_lock(&g_log.mu);
+    r->next = g_log.rings;
+    g_log.rings = r;
+    (void) pthread_mutex_unlock(&g_log.mu);
+    (void) pthread_setspecific(g_log.key, r);
+    tl_ring = r;
+    return (r);
+}
+
+/* リングへの追加 */
+// 0:追加した -1:空きがない
+static int
+log_push(struct log_ring *r, const char *rec, size_t size)
+{
+    struct log_rec *pad;
+    uint32_t head, tail, off, contig, need;
+
+    tail = r->tail;
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    off = tail & (LOG_RING_SIZE - 1);
+    contig = LOG_RING_SIZE - off;
+    // レコードは折り返さずに置くので、末尾に入らなければ詰め物をして先頭へ
+    need = size <= contig ? (uint32_t) size : contig + (uint32_t) size;
+    if (LOG_RING_SIZE - (tail - head) < need) {
+        return (-1);
+    }
+    if (size > contig) {
+        pad = (struct log_rec *) (r->data + off);
+        pad->size = contig;
+        pad->level = LOG_PAD;
+        off = 0;
+    }
+    (void) memcpy(r->data + off, rec, size);
+    __atomic_store_n(&r->tail, tail + need, __ATOMIC_RELEASE);
+    if (tail + need - head > LOG_RING_SIZE / 2) {
+        // 溢れる前に書き出してもらう
+        (void) pthread_cond_signal(&g_log.cond);
+    }
+    return (0);
+}
+
+/* ログの出力 */
+// 書き出しスレッドが動いていなければその場で変換して書き出す
+void
+log_write(int level, const char *fmt, ...)
+{
+    union {
+        char buf[LOG_REC_MAX];
+        struct log_rec align;
+    } rec;
+    char line[LOG_REC_MAX * 2];
+    struct log_ring *r = NULL;
+    va_list ap;
+    size_t size;
+
+    if (!__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE)
+            && __atomic_exchange_n(&g_log.restart, 0, __ATOMIC_ACQ_REL)) {
+        (void) log_start();
+    }
+    va_start(ap, fmt);
+    size = log_encode(rec.buf, sizeof(rec.buf), level, fmt, ap);
+    va_end(ap);
+    if (__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE)) {
+        r = log_ring_get();
+    }
+    if (r == NULL) {
+        log_out(line, log_format(&rec.align, line, sizeof(line) - 1));
+        return;
+    }
+    if (log_push(r, rec.buf, size) == -1) {
+        // 書き出しが追いつかないときは呼び出し側を待たせずに捨てる
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* 溜まっているログの書き出し */
+void
+log_flush(void)
+{
+    (void) pthread_mutex_lock(&g_log.mu);
+    log_drain_locked();
+    (void) pthread_mutex_unlock(&g_log.mu);
+}
+
+/* ログレベルの変更（シグナルハンドラ） */
+// SIGUSR1で詳しく、SIGUSR2で簡潔にする
+static void
+log_level_signal(int sig)
+{
+    int level = __atomic_load_n(&g_log_level, __ATOMIC_RELAXED);
+
+    if (sig == SIGUSR1 && level < LOG_LEVEL_DEBUG) {
+        level++;
+    } else if (sig == SIGUSR2 && level > LOG_LEVEL_ERR) {
+        level--;
+    }
+    __atomic_store_n(&g_log_level, level, __ATOMIC_RELAXED);
+}
+
+/* fork前後の処理 */
+// 子プロセスには呼び出したスレッドしか残らないので、ほかのスレッドのリングは捨て、
+// 親が書き出す分も捨てて、最初の出力で書き出しスレッドを作り直す
+static void
+log_prefork(void)
+{
+    (void) pthread_mutex_lock(&g_log.mu);
+}
+
+static void
+log_postfork_parent(void)
+{
+    (void) pthread_mutex_unlock(&g_log.mu);
+}
+
+static void
+log_postfork_child(void)
+{
+    struct log_ring *r, *next;
+
+    (void) pthread_mutex_init(&g_log.mu, NULL);
+    (void) pthread_cond_init(&g_log.cond, NULL);
+    for (r = g_log.rings; r != NULL; r = next) {
+        next = r->next;
+        if (r != tl_ring) {
+            (void) munmap(r, sizeof(*r));
+        }
+    }
+    g_log.rings = tl_ring;
+    if (tl_ring != NULL) {
+        tl_ring->next = NULL;
+        tl_ring->head = tl_ring->tail;
+        tl_ring->reported = tl_ring->dropped;
+    }
+    if (g_log.running) {
+        g_log.running = 0;
+        g_log.restart = 1;
+    }
+}
+
+/* 書き出しスレッドの開始 */
+static int
+log_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    int err;
+
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, log_writer, NULL);
+    (void) pthread_attr_destroy(&attr);
+    if (err != 0) {
+        (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+        return (-1);
+    }
+    __atomic_store_n(&g_log.running, 1, __ATOMIC_RELEASE);
+    return (0);
+}
+
+/* 非同期ログの開始 */
+// 以後のLOGは呼び出したスレッドのリングに入り、書き出しスレッドがまとめてwriteする
+// デーモン化の後、スレッドを作る前に呼ぶ（2回目以降はレベルを変えるだけ）
+// 0:成功 -1:エラー（その場で書き出すまま）
+int
+log_init(int level)
+{
+    struct sigaction sa;
+
+    __atomic_store_n(&g_log_level, level, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE)) {
+        // 2回目以降はレベルを変えるだけ
+        return (0);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_level_signal;
+    sa.sa_flags = SA_RESTART;
+    (void) sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGUSR1, &sa, NULL);
+    (void) sigaction(SIGUSR2, &sa, NULL);
+    if (pthread_key_create(&g_log.key, log_thread_exit) != 0
+            || pthread_atfork(log_prefork, log_postfork_parent, log_postfork_child) != 0) {
+        return (-1);
+    }
+    // exitするときに溜まっている分を書き出す
+    (void) atexit(log_flush);
+    return (log_start());
+}
@@ -0,0 +1,42 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <sys/types.h>
+
+/* ログレベル */
+#define LOG_LEVEL_ERR 0     // エラー
+#define LOG_LEVEL_INFO 1    // 接続ごとの受付・切断
+#define LOG_LEVEL_DEBUG 2   // 要求ごとの内容
+
+/* スレッドごとのリングのサイズ（2のべき乗） */
+#define LOG_RING_SIZE (256 * 1024)
+/* 1件の最大長（これに収まらない文字列は切り詰める） */
+#define LOG_REC_MAX 4096
+/* 書き出しスレッドが溜まった分を書き出す間隔（ミリ秒） */
+#define LOG_FLUSH_MS 10
+
+/* 現在のログレベル（これより詳しいメッセージは捨てる） */
+extern int g_log_level;
+
+/* そのレベルのメッセージを出すか */
+// 出すときだけ引数の文字列を作る場合に使う
+#define LOG_ENABLED(level) ((level) <= __atomic_load_n(&g_log_level, __ATOMIC_RELAXED))
+
+/* ログの出力 */
+// レベルが無効なら引数も評価しない
+// 書式の変換は書き出しスレッドで行い、呼び出し側は引数をリングにコピーするだけ
+#define LOG(level, ...) \
+    do { \
+        if (LOG_ENABLED(level)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/* log.c */
+int log_level_parse(const char *name);
+int log_init(int level);
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+
+#endif
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+/* スレッドごとの集計 */
+// 書くのはそのスレッドだけなのでロックも原子的な読み書き変更（lock付きの命令）もいらない
+// 読む側（管理用ポート）と書く側がキャッシュラインを奪い合わないよう、
+// ほかのスレッドの集計とは別の行に置く
+struct metrics_shard {
+    struct metrics_shard *next;
+    uint64_t c[M_COUNTERS];
+    struct metrics_hist service;
+} __attribute__((aligned(64)));
+
+/* 全スレッドの集計の一覧 */
+// スレッドが終了しても数えた分は残すので解放しない
+static struct metrics_shard *g_shards;
+static pthread_mutex_t g_shards_mu = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct metrics_shard *tl_shard;
+
+/* 呼び出したスレッドの集計 */
+// 最初に数えるときに作って一覧に加える
+static struct metrics_shard *
+metrics_shard(void)
+{
+    struct metrics_shard *s;
+
+    if ((s = tl_shard) != NULL) {
+        return (s);
+    }
+    if (posix_memalign((void **) &s, 64, sizeof(*s)) != 0) {
+        return (NULL);
+    }
+    (void) memset(s, 0, sizeof(*s));
+    (void) pthread_mutex_lock(&g_shards_mu);
+    s->next = g_shards;
+    __atomic_store_n(&g_shards, s, __ATOMIC_RELEASE);
+    (void) pthread_mutex_unlock(&g_shards_mu);
+    tl_shard = s;
+    return (s);
+}
+
+/* 1つの値への加算 */
+// 書くのは1スレッドだけなので、読む側が壊れた値を見ないようにストアだけ原子的に行う
+static void
+metrics_inc(uint64_t *p, uint64_t n)
+{
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+/* 単調増加する時刻（ナノ秒） */
+uint64_t
+metrics_now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+/* カウンタへの加算 */
+void
+metrics_add(int id, uint64_t n)
+{
+    struct metrics_shard *s;
+
+    if ((s = metrics_shard()) != NULL) {
+        metrics_inc(&s->c[id], n);
+    }
+}
+
+/* 値の入る区間 */
+// METRICS_SUB未満はそのまま、それ以上は2のべき乗ごとにMETRICS_SUB等分した区間
+static int
+metrics_bucket(uint64_t v)
+{
+    int e;
+
+    if (v < METRICS_SUB) {
+        return ((int) v);
+    }
+    e = 63 - __builtin_clzll(v);
+    if (e > METRICS_MAX_EXP) {
+        return (METRICS_BUCKETS - 1);
+    }
+    return ((e - METRICS_SUB_BITS + 1) * METRICS_SUB
+            + (int) ((v >> (e - METRICS_SUB_BITS)) & (METRICS_SUB - 1)));
+}
+
+/* 区間の上限 */
+static uint64_t
+metrics_bucket_high(int b)
+{
+    int e;
+
+    if (b < METRICS_SUB) {
+        return ((uint64_t) b);
+    }
+    e = b / METRICS_SUB + METRICS_SUB_BITS - 1;
+    return (((uint64_t) (METRICS_SUB + b % METRICS_SUB + 1) << (e - METRICS_SUB_BITS)) - 1);
+}
+
+/* サービス時間の記録 */
+// 同じ時間で応答したn件分をまとめて数える
+void
+metrics_service(uint64_t ns, uint64_t n)
+{
+    struct metrics_shard *s;
+
+    if (n == 0 || (s = metrics_shard()) == NULL) {
+        return;
+    }
+    metrics_inc(&s->service.buckets[metrics_bucket(ns)], n);
+    metrics_inc(&s->service.count, n);
+    metrics_inc(&s->service.sum, ns * n);
+}
+
+/* 全スレッドの合計 */
+void
+metrics_snapshot(struct metrics_snap *snap)
+{
+    struct metrics_shard *s;
+    int i;
+
+    (void) memset(snap, 0, sizeof(*snap));
+    for (s = __atomic_load_n(&g_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+        for (i = 0; i < M_COUNTERS; i++) {
+            snap->c[i] += __atomic_load_n(&s->c[i], __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < METRICS_BUCKETS; i++) {
+            snap->service.buckets[i] += __atomic_load_n(&s->service.buckets[i], __ATOMIC_RELAXED);
+        }
+        snap->service.count += __atomic_load_n(&s->service.count, __ATOMIC_RELAXED);
+        snap->service.sum += __atomic_load_n(&s->service.sum, __ATOMIC_RELAXED);
+    }
+}
+
+/* 分位点 */
+// qの割合の値が入っている区間の上限を返す（記録がなければ0）
+uint64_t
+metrics_quantile(const struct metrics_hist *h, double q)
+{
+    uint64_t total = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        total += h->buckets[i];
+    }
+    if (total == 0) {
+        return (0);
+    }
+    rank = (uint64_t) (q * (double) total);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        if ((seen += h->buckets[i]) > rank) {
+            break;
+        }
+    }
+    return (metrics_bucket_high(i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1));
+}
+
+/* テキスト形式への変換 */
+// Prometheusのテキスト形式（1行に名前と値）で書き、長さを返す
+size_t
+metrics_format(char *buf, size_t size)
+{
+    static const struct {
+        const char *name, *type;
+        int id;
+    } counters[] = {
+        {"server_accepts_total", "counter", M_ACCEPTS},
+        {"server_requests_total", "counter", M_REQUESTS},
+        {"server_bytes_received_total", "counter", M_BYTES_IN},
+        {"server_bytes_sent_total", "counter", M_BYTES_OUT},
+        {"server_recv_errors_total", "counter", M_RECV_ERRORS},
+        {"server_send_errors_total", "counter", M_SEND_ERRORS},
+    };
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    struct metrics_snap snap;
+    size_t i, n = 0;
+
+    metrics_snapshot(&snap);
+    for (i = 0; i < sizeof(counters) / sizeof(counters[0]) && n < size; i++) {
+        n += (size_t) snprintf(buf + n, size - n, "# TYPE %s %s\n%s %llu\n",
+                                counters[i].name, counters[i].type, counters[i].name,
+                                (unsigned long long) snap.c[counters[i].id]);
+    }
+    if (n < size) {
+        n += (size_t) snprintf(buf + n, size - n,
+                                "# TYPE server_connections_active gauge\n"
+                                "server_connections_active %llu\n"
+                                "# TYPE server_service_time_seconds summary\n",
+                                (unsigned long long) (snap.c[M_ACCEPTS] - snap.c[M_CLOSES]));
+    }
+    for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]) && n < size; i++) {
+        n += (size_t) snprintf(buf + n, size - n,
+                                "server_service_time_seconds{quantile=\"%g\"} %.9f\n",
+                                quantiles[i], metrics_quantile(&snap.service, quantiles[i]) / 1e9);
+    }
+    if (n < size) {
+        n += (size_t) snprintf(buf + n, size - n,
+                                "server_service_time_seconds_sum %.9f\n"
+                                "server_service_time_seconds_count %llu\n",
+                                snap.service.sum / 1e9, (unsigned long long) snap.service.count);
+    }
+    return (n < size ? n : size);
+}
@@ -0,0 +1,48 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/* カウンタの番号 */
+#define M_ACCEPTS 0         // 受け付けた接続数
+#define M_CLOSES 1          // 閉じた接続数（受け付けた数との差が接続中の数）
+#define M_REQUESTS 2        // 処理した要求数
+#define M_BYTES_IN 3        // 受信したバイト数
+#define M_BYTES_OUT 4       // 送信したバイト数
+#define M_RECV_ERRORS 5     // 受信エラー数
+#define M_SEND_ERRORS 6     // 送信エラー数
+#define M_COUNTERS 7
+
+/* ヒストグラムの2のべき乗ごとの分割数（2^METRICS_SUB_BITS） */
+// 値は1/8の相対誤差で数える（HDRヒストグラムと同じ対数・線形の2段の区切り）
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+/* ヒストグラムで区別する最大の2のべき乗（ナノ秒で約18分、これより大きい値はまとめる） */
+#define METRICS_MAX_EXP 40
+/* ヒストグラムの区間の数 */
+#define METRICS_BUCKETS ((METRICS_MAX_EXP - METRICS_SUB_BITS + 2) * METRICS_SUB)
+
+/* 遅延のヒストグラム（ナノ秒） */
+struct metrics_hist {
+    uint64_t count;     // 記録した件数
+    uint64_t sum;       // 合計
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+/* 全スレッドを合計した値 */
+struct metrics_snap {
+    uint64_t c[M_COUNTERS];
+    struct metrics_hist service;    // 要求の受信から応答の送信までの時間
+};
+
+/* metrics.c */
+uint64_t metrics_now(void);
+void metrics_add(int id, uint64_t n);
+void metrics_service(uint64_t ns, uint64_t n);
+void metrics_snapshot(struct metrics_snap *s);
+uint64_t metrics_quantile(const struct metrics_hist *h, double q);
+size_t metrics_format(char *buf, size_t size);
+
+#endif
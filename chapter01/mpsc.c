@@ -0,0 +1,128 @@
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mpsc.h"
+
+/* リングの初期化 */
+// capは2のべき乗に切り上げる
+int
+mpsc_init(struct mpsc *q, size_t cap)
+{
+    size_t i, n;
+
+    for (n = 1; n < cap; n <<= 1);
+    (void) memset(q, 0, sizeof(*q));
+    if ((q->slots = calloc(n, sizeof(*q->slots))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    for (i = 0; i < n; i++) {
+        q->slots[i].seq = i;
+    }
+    q->mask = n - 1;
+    if ((q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        free(q->slots);
+        return (-1);
+    }
+    return (0);
+}
+
+/* 追加（生産者） */
+// 0:成功 -1:満杯
+int
+mpsc_push(struct mpsc *q, const struct handoff *h)
+{
+    struct mpsc_slot *slot;
+    size_t pos, seq;
+    intptr_t diff;
+    uint64_t one = 1;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            // 空き要素なので書き込み位置を確保する
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 消費者が1周遅れているので満杯
+            return (-1);
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->h = *h;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    /* ドアベル */
+    // 消費者が眠る準備をしているときだけeventfdに書く
+    // releaseのストアは後のロードと入れ替わりうるので、フェンスで書き込みを先に見せる
+    // （消費者はsleepingを立ててからseqを見直すので、どちらかが必ず相手に気づく）
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        (void) write(q->efd, &one, sizeof(one));
+    }
+    return (0);
+}
+
+/* まとめて取り出し（消費者） */
+// 書き込み済みの要素を最大max個取り出して個数を返す
+size_t
+mpsc_pop_batch(struct mpsc *q, struct handoff *out, size_t max)
+{
+    struct mpsc_slot *slot;
+    size_t n;
+
+    for (n = 0; n < max; n++) {
+        slot = &q->slots[q->head & q->mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->head + 1) {
+            break;
+        }
+        out[n] = slot->h;
+        // 1周後の書き込みを許可する
+        __atomic_store_n(&slot->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+        q->head++;
+    }
+    return (n);
+}
+
+/* 眠る前の準備（消費者） */
+// 1:眠ってよい 0:要素が残っているので眠らない
+int
+mpsc_prepare_sleep(struct mpsc *q)
+{
+    struct mpsc_slot *slot;
+
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+    // フラグを立てた後に要素を見直して、取りこぼしがないようにする
+    slot = &q->slots[q->head & q->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == q->head + 1) {
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+        return (0);
+    }
+    return (1);
+}
+
+/* 起床後の処理（消費者） */
+// ドアベルが鳴っていたときはeventfdも空にする
+void
+mpsc_wake(struct mpsc *q, int rung)
+{
+    uint64_t cnt;
+
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+    if (rung) {
+        (void) read(q->efd, &cnt, sizeof(cnt));
+    }
+}
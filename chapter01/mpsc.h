@@ -0,0 +1,42 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stddef.h>
+
+/* 受付済み接続の受け渡し情報 */
+struct handoff {
+    int fd;
+    socklen_t len;
+    struct sockaddr_storage from;
+};
+
+/* リングの1要素 */
+// seqで書き込み済みかどうかを判定する
+struct mpsc_slot {
+    size_t seq;
+    struct handoff h;
+};
+
+/* 複数生産者・単一消費者の固定長リング */
+// 生産者（acceptスレッド）はCASで書き込み位置を確保し、消費者はロックなしで読む
+struct mpsc {
+    struct mpsc_slot *slots;
+    size_t mask;
+    int efd;    // 消費者が眠っているときだけ鳴らすドアベル
+    // 生産者と消費者が触る変数はキャッシュラインを分ける
+    size_t tail __attribute__((aligned(64)));
+    size_t head __attribute__((aligned(64)));
+    int sleeping __attribute__((aligned(64)));
+};
+
+/* mpsc.c */
+int mpsc_init(struct mpsc *q, size_t cap);
+int mpsc_push(struct mpsc *q, const struct handoff *h);
+size_t mpsc_pop_batch(struct mpsc *q, struct handoff *out, size_t max);
+int mpsc_prepare_sleep(struct mpsc *q);
+void mpsc_wake(struct mpsc *q, int rung);
+
+#endif
@@ -0,0 +1,141 @@
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NLSCAN_X86
+#endif
+
+#include "nlscan.h"
+
+/* SIMDを使わない検索 */
+// SIMDが使えないときと、SIMDで扱えない端数の処理に使う
+static size_t
+nlscan_scalar(const char *buf, size_t from, size_t to, unsigned *pos, size_t max)
+{
+    const char *p = buf + from, *e = buf + to;
+    size_t n = 0;
+
+    while (n < max && p < e && (p = memchr(p, '\n', (size_t) (e - p))) != NULL) {
+        pos[n++] = (unsigned) (p - buf);
+        p++;
+    }
+    return (n);
+}
+
+#ifdef NLSCAN_X86
+/* 比較結果のビットマスクから位置を取り出す */
+static inline size_t
+nlscan_mask(uint64_t mask, size_t base, unsigned *pos, size_t n, size_t max)
+{
+    while (mask != 0 && n < max) {
+        pos[n++] = (unsigned) (base + (size_t) __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+    return (n);
+}
+
+/* SSE2による検索 */
+// 64バイトずつ16バイト単位で'\n'と比較し、一致したビットを順に位置に変換する
+__attribute__((target("sse2")))
+static size_t
+nlscan_sse2(const char *buf, size_t from, size_t to, unsigned *pos, size_t max)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t mask;
+    size_t i, k, n = 0;
+
+    for (i = from; i + 64 <= to && n < max; i += 64) {
+        mask = 0;
+        for (k = 0; k < 4; k++) {
+            mask |= (uint64_t) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(
+                            _mm_loadu_si128((const __m128i *) (buf + i + k * 16)), nl))
+                    << (k * 16);
+        }
+        n = nlscan_mask(mask, i, pos, n, max);
+    }
+    return (n + nlscan_scalar(buf, i, to, pos + n, max - n));
+}
+
+/* AVX2による検索 */
+// 32バイト単位で比較する以外はSSE2と同じ
+__attribute__((target("avx2")))
+static size_t
+nlscan_avx2(const char *buf, size_t from, size_t to, unsigned *pos, size_t max)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    uint64_t lo, hi;
+    size_t i, n = 0;
+
+    for (i = from; i + 64 <= to && n < max; i += 64) {
+        lo = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *) (buf + i)), nl));
+        hi = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *) (buf + i + 32)), nl));
+        n = nlscan_mask(lo | hi << 32, i, pos, n, max);
+    }
+    return (n + nlscan_scalar(buf, i, to, pos + n, max - n));
+}
+#endif
+
+/* 検索関数の一覧 */
+// CPUが対応していないものはnlscan_findで除く
+static const struct {
+    const char *name;
+    nlscan_func scan;
+} kernels[] = {
+#ifdef NLSCAN_X86
+    {"avx2", nlscan_avx2},
+    {"sse2", nlscan_sse2},
+#endif
+    {"scalar", nlscan_scalar},
+};
+
+/* 名前から検索関数を探す */
+// "auto"ならCPUが対応している中で最も速いものを返す
+nlscan_func
+nlscan_find(const char *name)
+{
+    size_t i;
+
+#ifdef NLSCAN_X86
+    __builtin_cpu_init();
+#endif
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(name, "auto") != 0 && strcmp(kernels[i].name, name) != 0) {
+            continue;
+        }
+#ifdef NLSCAN_X86
+        if ((kernels[i].scan == nlscan_avx2 && !__builtin_cpu_supports("avx2"))
+                || (kernels[i].scan == nlscan_sse2 && !__builtin_cpu_supports("sse2"))) {
+            continue;
+        }
+#endif
+        return (kernels[i].scan);
+    }
+    return (NULL);
+}
+
+/* 実行時に選んだ検索関数 */
+// 選ぶ前に呼ばれてもよいようにSIMDを使わないもので始める
+static nlscan_func g_scan = nlscan_scalar;
+
+/* 検索関数の選択 */
+// 起動時に一度だけ選び、nlscanは選んだ関数を呼ぶだけにする
+__attribute__((constructor))
+static void
+nlscan_init(void)
+{
+    g_scan = nlscan_find("auto");
+}
+
+/* 改行位置の検索 */
+// 1回の走査でbuf[from]からbuf[to]の手前までの改行を最大max個まとめて見つける
+// max個見つけたら残りは調べないので、続きはpos[max - 1] + 1から探す
+size_t
+nlscan(const char *buf, size_t from, size_t to, unsigned *pos, size_t max)
+{
+    return (g_scan(buf, from, to, pos, max));
+}
@@ -0,0 +1,15 @@
+#ifndef NLSCAN_H
+#define NLSCAN_H
+
+#include <sys/types.h>
+
+/* 改行位置の検索関数 */
+// buf[from]からbuf[to]の手前までの'\n'の位置を先頭から最大max個posに入れ、個数を返す
+typedef size_t (*nlscan_func)(const char *buf, size_t from, size_t to,
+                unsigned *pos, size_t max);
+
+/* nlscan.c */
+size_t nlscan(const char *buf, size_t from, size_t to, unsigned *pos, size_t max);
+nlscan_func nlscan_find(const char *name);
+
+#endif
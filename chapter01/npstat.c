@@ -0,0 +1,141 @@
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "statshm.h"
+
+/* 使い方の表示 */
+static void
+usage(void)
+{
+    (void) fprintf(stderr, "npstat [-a] [-i msec [-n count]] statsname\n");
+}
+
+/* 現在時刻（エポックからのナノ秒） */
+static uint64_t
+wall_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+/* 見出しの出力 */
+static void
+print_header(void)
+{
+    (void) printf("%-6s %7s %7s %10s %7s %12s %10s %14s %14s %6s %6s %9s %9s %9s\n",
+                    "slot", "pid", "age_ms", "accepts", "active", "requests", "req/s",
+                    "bytes_in", "bytes_out", "rerr", "serr", "p50_us", "p99_us", "p999_us");
+}
+
+/* 1行の出力 */
+// prevがあれば前回からの要求数の増え方を秒あたりにして出す
+static void
+print_snap(const char *label, int pid, double age_ms, const struct metrics_snap *s,
+            const struct metrics_snap *prev, double sec)
+{
+    char rate[32];
+
+    if (prev != NULL && sec > 0) {
+        (void) snprintf(rate, sizeof(rate), "%.0f",
+                        (double) (s->c[M_REQUESTS] - prev->c[M_REQUESTS]) / sec);
+    } else {
+        (void) snprintf(rate, sizeof(rate), "-");
+    }
+    (void) printf("%-6s %7d %7.0f %10llu %7llu %12llu %10s %14llu %14llu %6llu %6llu %9.1f %9.1f %9.1f\n",
+                    label, pid, age_ms,
+                    (unsigned long long) s->c[M_ACCEPTS],
+                    (unsigned long long) (s->c[M_ACCEPTS] - s->c[M_CLOSES]),
+                    (unsigned long long) s->c[M_REQUESTS], rate,
+                    (unsigned long long) s->c[M_BYTES_IN], (unsigned long long) s->c[M_BYTES_OUT],
+                    (unsigned long long) s->c[M_RECV_ERRORS], (unsigned long long) s->c[M_SEND_ERRORS],
+                    metrics_quantile(&s->service, 0.5) / 1e3,
+                    metrics_quantile(&s->service, 0.99) / 1e3,
+                    metrics_quantile(&s->service, 0.999) / 1e3);
+}
+
+/* サーバーの統計セグメントの表示 */
+// serverの-Sで書き出している共有メモリを読み、ワーカーごとのスロットを合計する
+// 読むのはマップしたメモリだけなので、短い間隔で繰り返してもサーバーには影響しない
+int
+main(int argc, char *argv[])
+{
+    const struct statshm *st;
+    static struct statshm_slot slot;
+    static struct metrics_snap total, prev, *prevslot;
+    char label[16];
+    uint64_t now, last = 0;
+    double sec;
+    int ch, i, aflag = 0, interval = 0, count = 0, n;
+
+    while ((ch = getopt(argc, argv, "ai:n:")) != -1) {
+        switch (ch) {
+        case 'a':
+            aflag = 1;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            usage();
+            return (EX_USAGE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1 || interval < 0 || count < 0) {
+        usage();
+        return (EX_USAGE);
+    }
+    if ((st = statshm_open(argv[0])) == NULL) {
+        return (EX_NOINPUT);
+    }
+    // スロットごとの前回の値（-aで秒あたりの要求数を出すため）
+    if ((prevslot = calloc(STATSHM_SLOTS, sizeof(*prevslot))) == NULL) {
+        perror("calloc");
+        return (EX_OSERR);
+    }
+    for (n = 0; ; n++) {
+        now = wall_ns();
+        sec = last != 0 ? (now - last) / 1e9 : 0;
+        (void) memset(&total, 0, sizeof(total));
+        print_header();
+        for (i = 0; i < STATSHM_SLOTS; i++) {
+            if (statshm_read(&st->slots[i], &slot) == -1) {
+                (void) fprintf(stderr, "slot %d:busy\n", i);
+                continue;
+            }
+            if (slot.pid == 0) {
+                continue;
+            }
+            statshm_sum(&total, &slot.snap);
+            if (aflag) {
+                (void) snprintf(label, sizeof(label), "%d", i);
+                print_snap(label, slot.pid, now > slot.updated_ns ? (now - slot.updated_ns) / 1e6 : 0,
+                            &slot.snap, last != 0 ? &prevslot[i] : NULL, sec);
+            }
+            prevslot[i] = slot.snap;
+        }
+        print_snap("total", st->hdr.pid, 0, &total, last != 0 ? &prev : NULL, sec);
+        prev = total;
+        last = now;
+        if (interval == 0 || (count > 0 && n + 1 >= count)) {
+            break;
+        }
+        (void) usleep((useconds_t) interval * 1000);
+    }
+    free(prevslot);
+    return (EX_OK);
+}
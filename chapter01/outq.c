@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "outq.h"
+
+/* 送信待ちキューの初期化 */
+void
+outq_init(struct outq *q)
+{
+    q->head = q->cnt = 0;
+    q->bytes = q->sent = 0;
+    q->zc_min = 0;
+    q->zc_sent = q->zc_done = 0;
+}
+
+/* 送信待ちの追加 */
+// 直前の要素とメモリ上で連続していれば1つにまとめる
+// 0:成功 -1:満杯
+int
+outq_push(struct outq *q, const void *base, size_t len)
+{
+    struct iovec *last;
+
+    if (len == 0) {
+        return (0);
+    }
+    if (q->cnt > 0) {
+        last = &q->iov[q->head + q->cnt - 1];
+        if ((const char *) last->iov_base + last->iov_len == (const char *) base) {
+            last->iov_len += len;
+            q->bytes += len;
+            return (0);
+        }
+    }
+    if (q->head + q->cnt == OUTQ_MAX) {
+        if (q->head == 0) {
+            return (-1);
+        }
+        // 送信済みで空いた先頭側へ詰める
+        (void) memmove(q->iov, q->iov + q->head, (size_t) q->cnt * sizeof(q->iov[0]));
+        q->head = 0;
+    }
+    q->iov[q->head + q->cnt].iov_base = (void *) base;
+    q->iov[q->head + q->cnt].iov_len = len;
+    q->cnt++;
+    q->bytes += len;
+    return (0);
+}
+
+/* 複数の送信待ちの追加 */
+// 途中で満杯にならないよう、先に全要素分の空きを確かめる
+// 0:成功 -1:満杯
+int
+outq_pushv(struct outq *q, const struct iovec *iov, int n)
+{
+    int i;
+
+    if (outq_room(q) < n) {
+        return (-1);
+    }
+    for (i = 0; i < n; i++) {
+        (void) outq_push(q, iov[i].iov_base, iov[i].iov_len);
+    }
+    return (0);
+}
+
+/* 追加できる要素数 */
+int
+outq_room(const struct outq *q)
+{
+    return (OUTQ_MAX - q->cnt);
+}
+
+/* 送信できた分を外す */
+void
+outq_consume(struct outq *q, size_t len)
+{
+    struct iovec *iov;
+    size_t n;
+
+    q->bytes -= len;
+    q->sent += len;
+    while (len > 0) {
+        iov = &q->iov[q->head];
+        n = len < iov->iov_len ? len : iov->iov_len;
+        iov->iov_base = (char *) iov->iov_base + n;
+        iov->iov_len -= n;
+        len -= n;
+        if (iov->iov_len == 0) {
+            q->head++;
+            q->cnt--;
+        }
+    }
+    if (q->cnt == 0) {
+        q->head = 0;
+    }
+}
+
+/* 送信待ちの送信 */
+// 溜まっている要素をまとめてsendmsgで送り、送れた分をキューから外す
+// 溜まっている量がzc_min以上ならMSG_ZEROCOPYでカーネルへのコピーを省く
+// 0:送信できるところまで送った -1:エラー
+int
+outq_flush(int fd, struct outq *q)
+{
+    struct msghdr msg;
+    ssize_t len;
+    int flags;
+
+    while (q->cnt > 0) {
+        // writevと同じだがMSG_NOSIGNALを付けるためにsendmsgを使う
+        (void) memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = q->iov + q->head;
+        msg.msg_iovlen = (size_t) (q->cnt < IOV_MAX ? q->cnt : IOV_MAX);
+        flags = MSG_NOSIGNAL;
+        if (q->zc_min > 0 && q->bytes >= q->zc_min) {
+            flags |= MSG_ZEROCOPY;
+        }
+        if ((len = sendmsg(fd, &msg, flags)) == -1
+                && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            // ページの固定に使えるメモリが足りないので今回はコピーで送る
+            flags &= ~MSG_ZEROCOPY;
+            len = sendmsg(fd, &msg, flags);
+        }
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 続きはEPOLLOUTで送る
+                return (0);
+            }
+            perror("sendmsg");
+            return (-1);
+        }
+        if (flags & MSG_ZEROCOPY) {
+            q->zc_sent++;
+        }
+        outq_consume(q, (size_t) len);
+    }
+    return (0);
+}
+
+/* MSG_ZEROCOPYの有効化 */
+// 送信待ちがminバイト以上溜まったときの送信をゼロコピーにする
+// ソケットが対応していなければこれまでどおりコピーで送る
+void
+outq_zerocopy(int fd, struct outq *q, size_t min)
+{
+    int one = 1;
+
+    if (min == 0) {
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+        perror("setsockopt(SO_ZEROCOPY)");
+        return;
+    }
+    q->zc_min = min;
+}
+
+/* ゼロコピー送信の完了通知の受け取り */
+// エラーキューに届いた通知をすべて読み、完了した送信の回数を数える
+// 1つの通知が連続した複数回の送信（ee_infoからee_dataまで）の完了を表す
+// 0:読みきった -1:ゼロコピー以外のエラー
+int
+outq_reap(int fd, struct outq *q)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct sock_extended_err *ee;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+
+    for (;;) {
+        (void) memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return (0);
+            }
+            perror("recvmsg(MSG_ERRQUEUE)");
+            return (-1);
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                errno = (int) ee->ee_errno;
+                perror("errqueue");
+                return (-1);
+            }
+            q->zc_done += ee->ee_data - ee->ee_info + 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // ループバックなどでカーネルが結局コピーしたなら、
+                // 完了待ちの分だけ損なのでこの接続では使わない
+                q->zc_min = 0;
+            }
+        }
+    }
+}
+
+/* 送信待ちの破棄 */
+// 接続を閉じるときに、まだ渡していない応答を捨てる
+// 送ったゼロコピー送信の完了待ちは残るので、outq_idleが真になるまでバッファは解放しない
+void
+outq_discard(struct outq *q)
+{
+    q->head = q->cnt = 0;
+    q->bytes = 0;
+}
+
+/* 送信待ちも完了待ちのゼロコピー送信もないか */
+// これが真になるまでは送信待ちが指すバッファを詰めたり解放したりしない
+int
+outq_idle(const struct outq *q)
+{
+    return (q->cnt == 0 && q->zc_sent == q->zc_done);
+}
@@ -0,0 +1,37 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* 送信待ちキューの最大要素数 */
+// 応答1つが要求の行と接尾辞の2要素になるので、受信バッファ分の行が入る程度にする
+#define OUTQ_MAX 256
+
+/* 送信待ちキュー */
+// 送信するデータの位置と長さだけを持ち、まとめて1回のsendmsg(writev相当)で送る
+struct outq {
+    struct iovec iov[OUTQ_MAX];
+    int head, cnt;      // iov[head]からcnt個が送信待ち
+    size_t bytes;       // 送信待ちの合計バイト数
+    size_t sent;        // 送信済みの合計バイト数（統計）
+    // MSG_ZEROCOPYで送る送信待ちの合計バイト数の下限（0なら使わない）
+    size_t zc_min;
+    // MSG_ZEROCOPYで送った回数と、そのうち完了通知を受け取った回数
+    // 一致するまでは送ったデータをカーネルが参照しているので書き換えない
+    unsigned zc_sent, zc_done;
+};
+
+/* outq.c */
+void outq_init(struct outq *q);
+int outq_push(struct outq *q, const void *base, size_t len);
+int outq_pushv(struct outq *q, const struct iovec *iov, int n);
+int outq_room(const struct outq *q);
+void outq_consume(struct outq *q, size_t len);
+int outq_flush(int fd, struct outq *q);
+void outq_zerocopy(int fd, struct outq *q, size_t min);
+int outq_reap(int fd, struct outq *q);
+int outq_idle(const struct outq *q);
+void outq_discard(struct outq *q);
+
+#endif
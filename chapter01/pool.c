@@ -0,0 +1,370 @@
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* 両端キューの容量（2のべき乗） */
+// 所有スレッドは共有キューから空いている分しか移さないので広げる必要はない
+#define DEQUE_SIZE 256
+/* 共有キューから一度に移す最大数 */
+#define GRAB_MAX (DEQUE_SIZE / 2)
+
+/* スレッドごとの両端キュー（Chase-Levの両端キュー） */
+// 所有スレッドだけがbottom側で積んで取り出し、他のスレッドはtop側から盗む
+// ロックは使わず、1つの仕事を所有スレッドと盗む側が取り合うときだけtopのCASで決める
+struct deque {
+    int64_t top __attribute__((aligned(64)));       // 盗む側が進める
+    int64_t bottom __attribute__((aligned(64)));    // 所有スレッドだけが動かす
+    struct task *buf[DEQUE_SIZE] __attribute__((aligned(64)));
+};
+
+/* 要求処理スレッドプール */
+// I/Oスレッドは共有キューに投入し、空いた要求処理スレッドが公平な分だけ自分の両端キューに移す
+// 自分のキューが空になったら他のスレッドのキュー、共有キューの順に探し、なければ眠る
+struct pool {
+    int nthreads;
+    struct deque *dq;
+    // 以下はmuで保護する
+    pthread_mutex_t mu;
+    pthread_cond_t cond;
+    struct task *head, *tail;   // 共有キュー
+    int nqueued;                // 共有キューの仕事の数
+    int nsleeping;              // 眠っているスレッド数
+    int nwake;                  // 起こしたがまだ起きていないスレッド数
+    // 作成に失敗したので作ったスレッドを終了させる
+    int stop;
+};
+
+/* ワーカースレッドの引数 */
+struct worker {
+    struct pool *p;
+    int id;
+};
+
+/* bottomへの追加（所有スレッド） */
+// 0:成功 -1:満杯
+static int
+deque_push(struct deque *d, struct task *t)
+{
+    int64_t b, top;
+
+    b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - top >= DEQUE_SIZE) {
+        return (-1);
+    }
+    __atomic_store_n(&d->buf[b & (DEQUE_SIZE - 1)], t, __ATOMIC_RELAXED);
+    // 盗む側がbottomの増加を見たときに中身も見えるようにする
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return (0);
+}
+
+/* bottomからの取り出し（所有スレッド） */
+// 最後の1つだけは盗む側と取り合うのでtopのCASで決める
+static struct task *
+deque_take(struct deque *d)
+{
+    struct task *t;
+    int64_t b, top;
+
+    b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    // bottomを下げたことを盗む側に見せてからtopを読む
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (top > b) {
+        // 空だった
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return (NULL);
+    }
+    t = __atomic_load_n(&d->buf[b & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == b) {
+        if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            // 盗まれた
+            t = NULL;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return (t);
+}
+
+/* topからの取り出し（盗む側） */
+// 他のスレッドと取り合って負けたときもNULLを返す
+static struct task *
+deque_steal(struct deque *d)
+{
+    struct task *t;
+    int64_t b, top;
+
+    top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b) {
+        return (NULL);
+    }
+    t = __atomic_load_n(&d->buf[top & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return (NULL);
+    }
+    return (t);
+}
+
+/* 完了通知 */
+// 完了リストが空だったときだけeventfdを鳴らす
+static void
+task_complete(struct task *t)
+{
+    struct task_done *d = t->done;
+    uint64_t one = 1;
+    int was_empty;
+
+    t->next = NULL;
+    (void) pthread_mutex_lock(&d->mu);
+    was_empty = (d->head == NULL);
+    if (was_empty) {
+        d->head = t;
+    } else {
+        d->tail->next = t;
+    }
+    d->tail = t;
+    (void) pthread_mutex_unlock(&d->mu);
+    if (was_empty) {
+        (void) write(d->efd, &one, sizeof(one));
+    }
+}
+
+/* 眠っているスレッドを1つ起こす（muを持って呼ぶ） */
+// 起こしたがまだ起きていないスレッドは数えず、同じスレッドを重ねて起こさない
+static void
+pool_wake(struct pool *p)
+{
+    if (p->nsleeping > p->nwake) {
+        p->nwake++;
+        (void) pthread_cond_signal(&p->cond);
+    }
+}
+
+/* 共有キューからの取り出し（muを持って呼ぶ） */
+// 1つを返し、公平な分（残りをスレッド数で割った分）までは自分の両端キューに移す
+// 移した仕事があって眠っているスレッドがいれば、盗みに行かせるために起こす
+static struct task *
+pool_grab(struct pool *p, struct deque *d)
+{
+    struct task *t, *u;
+    int n;
+
+    if ((t = p->head) == NULL) {
+        return (NULL);
+    }
+    p->head = t->next;
+    p->nqueued--;
+    n = p->nqueued / p->nthreads;
+    if (n > GRAB_MAX) {
+        n = GRAB_MAX;
+    }
+    for (; n > 0 && (u = p->head) != NULL; n--) {
+        if (deque_push(d, u) == -1) {
+            break;
+        }
+        p->head = u->next;
+        p->nqueued--;
+        pool_wake(p);
+    }
+    if (p->head == NULL) {
+        p->tail = NULL;
+    }
+    return (t);
+}
+
+/* 他のスレッドの両端キューから盗む */
+static struct task *
+pool_steal(struct pool *p, int id)
+{
+    struct task *t;
+    int i;
+
+    for (i = 1; i < p->nthreads; i++) {
+        if ((t = deque_steal(&p->dq[(id + i) % p->nthreads])) != NULL) {
+            return (t);
+        }
+    }
+    return (NULL);
+}
+
+/* 要求処理スレッド */
+// 両端キューの仕事は所有スレッドが起きている間に必ず処理するので、
+// 眠るかどうかは共有キューだけで決めてよい
+// 起こされたら共有キューを見て、なければ他のスレッドから1周盗んでから眠り直す
+static void *
+worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct pool *p = w->p;
+    struct deque *d = &p->dq[w->id];
+    struct task *t;
+    int woken;
+
+    for (;;) {
+        /* 自分のキューから取り出し、なければ盗む */
+        if ((t = deque_take(d)) == NULL && (t = pool_steal(p, w->id)) == NULL) {
+            /* 共有キューから取り出し、なければ眠る */
+            (void) pthread_mutex_lock(&p->mu);
+            for (woken = 0; (t = pool_grab(p, d)) == NULL && !p->stop && !woken;) {
+                p->nsleeping++;
+                (void) pthread_cond_wait(&p->cond, &p->mu);
+                p->nsleeping--;
+                if (p->nwake > 0) {
+                    p->nwake--;
+                }
+                woken = 1;
+            }
+            if (p->stop) {
+                (void) pthread_mutex_unlock(&p->mu);
+                free(w);
+                return (NULL);
+            }
+            (void) pthread_mutex_unlock(&p->mu);
+            if (t == NULL) {
+                continue;
+            }
+        }
+        /* 要求処理 */
+        t->run(t);
+        task_complete(t);
+    }
+    return (NULL);
+}
+
+/* 作成途中のスレッドプールの破棄 */
+// 起動済みのnstarted個のスレッドを止めて待ち、キューとプールを解放する
+// 仕事は投入されていないので、スレッドはすぐ眠りに入ってから終了する
+static void
+pool_destroy(struct pool *p, pthread_t *tids, int nstarted)
+{
+    int i;
+
+    (void) pthread_mutex_lock(&p->mu);
+    p->stop = 1;
+    (void) pthread_cond_broadcast(&p->cond);
+    (void) pthread_mutex_unlock(&p->mu);
+    for (i = 0; i < nstarted; i++) {
+        (void) pthread_join(tids[i], NULL);
+    }
+    (void) pthread_cond_destroy(&p->cond);
+    (void) pthread_mutex_destroy(&p->mu);
+    free(p->dq);
+    free(p);
+}
+
+/* スレッドプールの作成 */
+// 途中で失敗したら、それまでに作ったスレッドとキューを片付けてNULLを返す
+struct pool *
+pool_create(int nthreads)
+{
+    struct pool *p;
+    struct worker *w;
+    pthread_t *tids;
+    int i, err;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL) {
+        perror("calloc");
+        return (NULL);
+    }
+    // topとbottomを別のキャッシュラインに置くので、両端キューは行の境界に揃える
+    if (posix_memalign((void **) &p->dq, 64, (size_t) nthreads * sizeof(*p->dq)) != 0) {
+        p->dq = NULL;
+    }
+    if (p->dq == NULL || (tids = calloc((size_t) nthreads, sizeof(*tids))) == NULL) {
+        perror("calloc");
+        free(p->dq);
+        free(p);
+        return (NULL);
+    }
+    (void) memset(p->dq, 0, (size_t) nthreads * sizeof(*p->dq));
+    p->nthreads = nthreads;
+    (void) pthread_mutex_init(&p->mu, NULL);
+    (void) pthread_cond_init(&p->cond, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if ((w = malloc(sizeof(*w))) == NULL) {
+            perror("malloc");
+            pool_destroy(p, tids, i);
+            free(tids);
+            return (NULL);
+        }
+        w->p = p;
+        w->id = i;
+        if ((err = pthread_create(&tids[i], NULL, worker_thread, w)) != 0) {
+            (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+            free(w);
+            pool_destroy(p, tids, i);
+            free(tids);
+            return (NULL);
+        }
+    }
+    // 全部そろってから切り離す（それまでは失敗時にjoinで待てるようにしておく）
+    for (i = 0; i < nthreads; i++) {
+        (void) pthread_detach(tids[i]);
+    }
+    free(tids);
+    return (p);
+}
+
+/* 仕事の投入 */
+// I/Oスレッドから呼ばれ、共有キューの末尾に積む
+// 両端キューに積めるのは所有スレッドだけなので、振り分けは取り出す側が行う
+void
+pool_submit(struct pool *p, struct task *t)
+{
+    t->next = NULL;
+    (void) pthread_mutex_lock(&p->mu);
+    if (p->tail == NULL) {
+        p->head = t;
+    } else {
+        p->tail->next = t;
+    }
+    p->tail = t;
+    p->nqueued++;
+    /* 眠っているスレッドがいれば起こす */
+    pool_wake(p);
+    (void) pthread_mutex_unlock(&p->mu);
+}
+
+/* 完了通知先の初期化 */
+int
+task_done_init(struct task_done *d)
+{
+    if ((d->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        return (-1);
+    }
+    (void) pthread_mutex_init(&d->mu, NULL);
+    d->head = d->tail = NULL;
+    return (0);
+}
+
+/* 完了した仕事の受け取り */
+// eventfdを空にして完了リストをまとめて返す
+struct task *
+task_done_take(struct task_done *d)
+{
+    struct task *t;
+    uint64_t cnt;
+
+    (void) read(d->efd, &cnt, sizeof(cnt));
+    (void) pthread_mutex_lock(&d->mu);
+    t = d->head;
+    d->head = d->tail = NULL;
+    (void) pthread_mutex_unlock(&d->mu);
+    return (t);
+}
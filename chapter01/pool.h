@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+struct task;
+
+/* 完了通知先 */
+// I/Oスレッドごとに1つ持ち、eventfdをepollに登録して完了を受け取る
+struct task_done {
+    int efd;
+    pthread_mutex_t mu;
+    struct task *head, *tail;
+};
+
+/* 要求処理スレッドに渡す仕事 */
+// 呼び出し側の構造体に埋め込んで使う
+struct task {
+    void (*run)(struct task *t);
+    struct task_done *done;
+    struct task *next;
+};
+
+struct pool;
+
+/* pool.c */
+struct pool *pool_create(int nthreads);
+void pool_submit(struct pool *p, struct task *t);
+int task_done_init(struct task_done *d);
+struct task *task_done_take(struct task_done *d);
+
+#endif
@@ -0,0 +1,81 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "server.h"
+#include "framer.h"
+
+/* 1行分の要求処理（応答のiovec作成） */
+// lineは改行を除いたlenバイトの要求
+// 応答は要求の行そのものと固定の接尾辞を指すiovecで表し、コピーはしない
+// lineは応答を送り終えるまで書き換えないこと
+// iovに入れた要素数を返す
+int
+line_response_iov(const char *line, size_t len, struct iovec *iov)
+{
+    static const char suffix[] = RESP_SUFFIX;
+
+    iov[0].iov_base = (void *) line;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (void *) suffix;
+    iov[1].iov_len = sizeof(suffix) - 1;
+    return (RESP_IOV);
+}
+
+/* 要求1つ分の応答（iovec作成） */
+// テキストの行もバイナリのフレームも同じく要求そのものと接尾辞で応答する
+// フレームの場合は処理済みの要求ヘッダを応答の長さ（ペイロードと接尾辞）に
+// 書き換え、ペイロードと続けて指すのでやはりコピーはしない
+// iovに入れた要素数を返す
+int
+request_response_iov(struct framer *f, const char *req, size_t len, struct iovec *iov)
+{
+    uint32_t n;
+    char *hdr;
+    int cnt;
+
+    cnt = line_response_iov(req, len, iov);
+    if (f->mode == FRAMER_BINARY) {
+        // reqはフレーマーの受信バッファの中なので、直前のヘッダは書き換えてよい
+        hdr = (char *) req - FRAMER_HDR;
+        n = htonl((uint32_t) (len + iov[1].iov_len));
+        (void) memcpy(hdr, &n, sizeof(n));
+        iov[0].iov_base = hdr;
+        iov[0].iov_len += FRAMER_HDR;
+    }
+    return (cnt);
+}
+
+/* サイズ指定文字列連結 */
+// sizeはコピー先バッファのサイズを想定
+size_t
+mystrlcat(char *dst, const char *src, size_t size)
+{
+    const char *ps;
+    char *pd, *pde;
+    size_t dlen, lest;
+
+    // コピー先文字列の現在の終端まで移動
+    // 終端>sizeの場合はコピーせず終了
+    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
+    dlen = pd - dst;
+    if (size - dlen == 0) {
+        return (dlen + strlen(src));
+    }
+    // コピー先バッファの終端位置
+    pde = dst + size - 1;
+    // srcをコピーしきるかバッファの終端に達するまでコピー
+    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
+       *pd = *ps;
+    }
+    // コピー先バッファの残りを\0で埋める
+    for (; pd <= pde; pd++) {
+        *pd = '\0';
+    }
+    while (*ps++);
+    return (dlen + (ps - src - 1));
+}
@@ -1,6 +1,9 @@
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -9,29 +12,105 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
-void send_recv_loop(int acc);
+#include "server.h"
+#include "framer.h"
+#include "outq.h"
+#include "slab.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "statshm.h"
+
+/* 起動オプション */
+struct server_opt g_opt;
 
 /* サーバーソケットの準備 */
 int
 server_socket(const char *portnm)
+{
+    return (server_socket_by_hostname(NULL, portnm, SOCK_STREAM, 0));
+}
+
+/* Unixドメインのサーバーソケットの準備 */
+// 同じホストのクライアント向けで、TCP/IPのスタックを通らない
+// 前回の起動で残ったソケットファイルは消してからbindする
+static int
+unix_server_socket(const char *path, int socktype, int reuseport)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int soc;
+
+    if (socktype != SOCK_STREAM || reuseport) {
+        // パスは1つのソケットでしかbindできず、SO_REUSEPORTで共有できない
+        (void) fprintf(stderr, "%s requires a stream engine without -t\n", UNIX_PREFIX);
+        return (-1);
+    }
+    (void) memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        (void) fprintf(stderr, "%s%s:path too long\n", UNIX_PREFIX, path);
+        return (-1);
+    }
+    (void) strcpy(addr.sun_path, path);
+    (void) fprintf(stderr, "path=%s\n", path);
+
+    /* ソケットの生成 */
+    if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    /* 残っているソケットファイルの削除 */
+    // ソケット以外のファイルは消さずにbindのエラーにする
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        (void) unlink(path);
+    }
+    /* ソケットにパスを指定 */
+    if (bind(soc, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        (void) close(soc);
+        return (-1);
+    }
+    /* アクセスバックログの指定 */
+    if (listen(soc, SOMAXCONN) == -1) {
+        perror("listen");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
+/* サーバーソケットの準備（アドレス指定） */
+// socktypeはSOCK_STREAM(TCP)かSOCK_DGRAM(UDP)で、UDPならlistenはしない
+// reuseportが真ならSO_REUSEPORTを付けて同じポートを複数ソケットで共有する
+// portnmが「unix:パス」ならそのパスのUnixドメインソケットにする（hostnmは使わない）
+int
+server_socket_by_hostname(const char *hostnm, const char *portnm, int socktype, int reuseport)
 {
     char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
     struct addrinfo hints, *res0;
     int soc, opt, errcode;
     socklen_t opt_len;
 
+    if (strncmp(portnm, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+        return (unix_server_socket(portnm + sizeof(UNIX_PREFIX) - 1, socktype, reuseport));
+    }
+
     /* アドレス情報のヒントをゼロクリア */
     (void) memset(&hints, 0, sizeof(hints));
-    // TCP/IPのサーバーを表すヒント
+    // TCP/IP(UDP/IP)のサーバーを表すヒント
     hints.ai_family = AF_INET;  // IP(Internet Protocol)
-    hints.ai_socktype = SOCK_STREAM;    // TCP(Transmission Control Protocol)
+    hints.ai_socktype = socktype;   // TCP(Transmission Control Protocol)かUDP
     hints.ai_flags = AI_PASSIVE;    // Serverを表す
 
     /* アドレス情報の決定 */
@@ -43,8 +122,9 @@ server_socket(const char *portnm)
     //   サービス名は/etc/servicesなどに書いてある
     // 第3引数はヒント情報
     // 第4引数に結果のアドレス情報が入る（あとで解放が必要）
-    if ((errcode = getaddrinfo(NULL, portnm, &hints, &res0)) != 0) {
+    if ((errcode = getaddrinfo(hostnm, portnm, &hints, &res0)) != 0) {
         (void) fprintf(stderr, "getaddrinfo():%s\n", gai_strerror(errcode));
+        return (-1);
     }
     if ((errcode = getnameinfo(res0->ai_addr, res0->ai_addrlen,
                             nbuf, sizeof(nbuf), // IPアドレス
@@ -73,6 +153,15 @@ server_socket(const char *portnm)
         freeaddrinfo(res0);
         return (-1);
     }
+    /* ソケットオプション（ポート共有フラグ）設定 */
+    // 同じポートでlistenしているソケット間にカーネルが接続を振り分ける
+    // UDPなら送信元のアドレスとポートごとにデータグラムを振り分ける
+    if (reuseport && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &opt, opt_len)) {
+        perror("setsockopt");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
 
     /* ソケットにアドレスを指定 */
     if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
@@ -85,7 +174,8 @@ server_socket(const char *portnm)
     /* アクセスバックログの指定 */
     // listenすると接続待ち受け可能な状態のsocketになる
     // アクセスバックログとは接続待ちのキューの数のことらしい
-    if (listen(soc, SOMAXCONN) == -1) {
+    // UDPは接続がないのでbindしたまま使う
+    if (socktype == SOCK_STREAM && listen(soc, SOMAXCONN) == -1) {
         perror("listen");
         (void) close(soc);
         freeaddrinfo(res0);
@@ -96,11 +186,89 @@ server_socket(const char *portnm)
     return (soc);
 }
 
+/* 10進数の書き込み */
+// 書いた次の位置を返す
+static char *
+put_dec(char *p, unsigned long v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続相手のアドレスの文字列化 */
+// IPなら「アドレス:ポート」、Unixドメインなら「unix:パス」（クライアントは名前なしが普通）
+// 数値にするだけなのでgetnameinfoは使わず、IPv4は自前で、IPv6はinet_ntopで変換する
+// 受付ごとに呼ばず、ログやアクセスログが文字列を必要とするときだけ呼ぶ
+void
+peer_name(const struct sockaddr *sa, socklen_t len, char *buf, size_t size)
+{
+    char tmp[PEER_NAME_MAX], *p = tmp;
+    const struct sockaddr_in6 *sin6;
+    const struct sockaddr_in *sin;
+    const struct sockaddr_un *sun;
+    const unsigned char *a;
+    unsigned port;
+    size_t n;
+    int i;
+
+    if (size == 0) {
+        return;
+    }
+    if (sa->sa_family == AF_UNIX) {
+        sun = (const struct sockaddr_un *) sa;
+        n = len > offsetof(struct sockaddr_un, sun_path)
+            ? len - offsetof(struct sockaddr_un, sun_path) : 0;
+        (void) snprintf(buf, size, "%s%.*s", UNIX_PREFIX, (int) n, sun->sun_path);
+        return;
+    }
+    if (sa->sa_family == AF_INET && len >= (socklen_t) sizeof(*sin)) {
+        sin = (const struct sockaddr_in *) sa;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+    } else if (sa->sa_family == AF_INET6 && len >= (socklen_t) sizeof(*sin6)) {
+        sin6 = (const struct sockaddr_in6 *) sa;
+        (void) inet_ntop(AF_INET6, &sin6->sin6_addr, tmp, INET6_ADDRSTRLEN);
+        p = tmp + strlen(tmp);
+        if (sin6->sin6_scope_id != 0) {
+            // リンクローカルのスコープはgetnameinfoのNI_NUMERICSCOPEと同じく番号で
+            *p++ = '%';
+            p = put_dec(p, sin6->sin6_scope_id);
+        }
+        port = ntohs(sin6->sin6_port);
+    } else {
+        (void) snprintf(buf, size, "?");
+        return;
+    }
+    *p++ = ':';
+    p = put_dec(p, port);
+    n = (size_t) (p - tmp) < size - 1 ? (size_t) (p - tmp) : size - 1;
+    (void) memcpy(buf, tmp, n);
+    buf[n] = '\0';
+}
+
 /* アクセプトループ */
+// 受け付けた接続を1つずつserveで処理する
+// serveは送受信したバイト数などをaiに集計し、クローズ後にアクセスログへ記録する
 void
-accept_loop(int soc)
+accept_serve(int soc, void (*serve)(int acc, struct access_info *ai))
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    char peer[PEER_NAME_MAX];
+    struct access_info ai;
     struct sockaddr_storage from;
     int acc;
     socklen_t len;
@@ -116,107 +284,413 @@ accept_loop(int soc)
                 perror("accept");
             }
         } else {
-            (void) getnameinfo((struct sockaddr *) &from, len,
-                            hbuf, sizeof(hbuf),
-                            sbuf, sizeof(sbuf),
-                            NI_NUMERICHOST | NI_NUMERICSERV);
-            (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+            // アドレスはそのまま持っておき、ログに出すときだけ文字列にする
+            access_begin(&ai, (struct sockaddr *) &from, len);
+            metrics_add(M_ACCEPTS, 1);
+            if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+                peer_name((struct sockaddr *) &from, len, peer, sizeof(peer));
+                LOG(LOG_LEVEL_INFO, "accept:%s\n", peer);
+            }
             /* 送受信ループ */
-            send_recv_loop(acc);
+            serve(acc, &ai);
             /* アクセプトソケットクローズ */
             (void) close(acc);
             acc = 0;
+            access_end(&ai);
+            metrics_add(M_CLOSES, 1);
         }
     }
 }
 
-/* サイズ指定文字列連結 */
-// sizeはコピー先バッファのサイズを想定
-size_t
-mystrlcat(char *dst, const char *src, size_t size)
+/* 1接続ずつ処理する反復サーバーのアクセプトループ */
+void
+accept_loop(int soc)
+{
+    accept_serve(soc, send_recv_loop);
+}
+
+/* ゼロコピー送信の完了待ち */
+// 送った応答が指す受信バッファを次の受信で詰める前に、カーネルが使い終えるのを待つ
+// 0:完了 -1:エラー
+static int
+zerocopy_wait(int acc, struct outq *out)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    // コピー先文字列の現在の終端まで移動
-    // 終端>sizeの場合はコピーせず終了
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    // コピー先バッファの終端位置
-    pde = dst + size - 1;
-    // srcをコピーしきるかバッファの終端に達するまでコピー
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-       *pd = *ps;
-    }
-    // コピー先バッファの残りを\0で埋める
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
+    struct pollfd pfd;
+
+    while (!outq_idle(out)) {
+        // エラーキューの通知はPOLLERRで分かる（eventsに指定しなくても返る）
+        pfd.fd = acc;
+        pfd.events = 0;
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return (-1);
+        }
+        if (outq_reap(acc, out) == -1) {
+            return (-1);
+        }
+    }
+    return (0);
 }
 
 /* 送受信ループ */
 void
-send_recv_loop(int acc)
+send_recv_loop(int acc, struct access_info *ai)
 {
-    char buf[512], *ptr;
-    ssize_t len;
+    const char *line;
+    char *ptr;
+    struct framer in;
+    struct outq out;
+    struct iovec iov[RESP_IOV];
+    size_t len, avail;
+    ssize_t n;
+    uint64_t start, counted = 0;
+    unsigned long nreq;
+
+    if (framer_init(&in, REQ_BUF_INIT, g_opt.max_line) == -1) {
+        return;
+    }
+    outq_init(&out);
+    outq_zerocopy(acc, &out, g_opt.zc_min);
     // 1クライアントとの送受信ループ
     // 1つのクライアントが切断される間で他のクライアントは待たされる
     for (;;) {
         /* 受信 */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+        // 前回の受信で残った行の途中に続けて受信する
+        if ((ptr = framer_space(&in, &avail)) == NULL) {
+            ai->reason = ACCESS_REJECT;
+            break;
+        }
+        if ((n = recv(acc, ptr, avail, 0)) == -1) {
             /* エラー */
             perror("recv");
+            metrics_add(M_RECV_ERRORS, 1);
+            ai->reason = ACCESS_ERROR;
             break;
         }
-        if (len == 0) {
+        // サービス時間は受信を終えてから応答を送り終えるまで
+        start = metrics_now();
+        ai->bytes_in += (uint64_t) n;
+        metrics_add(M_BYTES_IN, (uint64_t) n);
+        if (n == 0) {
             /* EOF */
-            (void) fprintf(stderr, "recv:EOF\n");
-            break;
+            // 改行のない最後の行も処理してから抜ける
+            LOG(LOG_LEVEL_INFO, "recv:EOF\n");
+            framer_eof(&in);
+        } else {
+            framer_commit(&in, (size_t) n);
         }
-        /* 文字列化・表示 */
-        buf[len] = '\0';
-        if((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
+        /* 要求処理 */
+        // 受信した中のすべての行を処理し、応答は受信バッファを指したまま
+        // 次の受信の前にまとめて送る
+        nreq = 0;
+        while (framer_next(&in, &line, &len)) {
+            LOG(LOG_LEVEL_DEBUG, "[client]%.*s\n", (int) len, line);
+            if (outq_room(&out) < RESP_IOV && outq_flush(acc, &out) == -1) {
+                metrics_add(M_SEND_ERRORS, 1);
+                ai->reason = ACCESS_ERROR;
+                break;
+            }
+            (void) outq_pushv(&out, iov, request_response_iov(&in, line, len, iov));
+            nreq++;
         }
-        (void) fprintf(stderr, "[client]%s\n", buf);
-        /* 応答文字列作成 */
-        (void) mystrlcat(buf, ":OK\r\b", sizeof(buf));
-        len = (ssize_t) strlen(buf);
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+        ai->requests += nreq;
+        metrics_add(M_REQUESTS, nreq);
+        if (ai->reason == ACCESS_ERROR
+                || outq_flush(acc, &out) == -1 || zerocopy_wait(acc, &out) == -1) {
             /* エラー */
-            perror("send");
+            if (ai->reason != ACCESS_ERROR) {
+                metrics_add(M_SEND_ERRORS, 1);
+            }
+            ai->reason = ACCESS_ERROR;
             break;
         }
+        metrics_service(metrics_now() - start, nreq);
+        metrics_add(M_BYTES_OUT, out.sent - counted);
+        counted = out.sent;
+        if (n == 0) {
+            break;
+        }
+        // 長い行で広げたバッファは次の受信を待つ間に戻しておく
+        framer_shrink(&in);
+    }
+    ai->bytes_out = out.sent;
+    metrics_add(M_BYTES_OUT, out.sent - counted);
+    // エラーで抜けたときも、カーネルに渡したゼロコピー送信が終わるまでバッファは返さない
+    outq_discard(&out);
+    if (zerocopy_wait(acc, &out) == -1) {
+        // 完了が分からないのでバッファは解放しない
+        return;
+    }
+    framer_free(&in);
+}
+
+/* ブロッキングモードのセット */
+int
+set_block(int fd, int flag)
+{
+    int flags;
+
+    // F_GETFLで現在のフラグを取得
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1) {
+        perror("fcntl");
+        return (-1);
+    }
+    // F_SETFLでフラグを設定
+    if (flag == 0) {
+        /* ノンブロッキング  */
+        (void) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    } else if (flag == 1) {
+        /* ブロッキング  */
+        (void) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
     }
+    return (0);
+}
+
+/* 送受信エンジンの一覧 */
+static const struct {
+    const char *name;
+    loop_func loop;
+    int socktype;       // 待ち受けソケットの種類
+} engines[] = {
+    {"blocking", accept_loop, SOCK_STREAM}, // 1接続ずつ処理する反復サーバー
+    {"epoll", epoll_loop, SOCK_STREAM},     // epollによる多重化ループ
+    {"uring", uring_loop, SOCK_STREAM},     // io_uringによる完了ベースのループ
+    {"splice", splice_loop, SOCK_STREAM},   // spliceでカーネル内だけで折り返すエコー（接尾辞なし）
+    {"zcrecv", zcrecv_loop, SOCK_STREAM},   // 受信ページをmmapで受け取って返すエコー（接尾辞なし）
+    {"udp", udp_loop, SOCK_DGRAM},          // recvmmsg/sendmmsgによるUDPのデータグラム単位の応答
+    {"shm", shm_loop, SOCK_STREAM},         // unix:で受け付けて共有メモリのリングでやりとりする
+};
+
+/* 名前から送受信エンジンを探す */
+// socktypeにはそのエンジンが使う待ち受けソケットの種類を返す
+loop_func
+find_engine(const char *name, int *socktype)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i].name, name) == 0) {
+            *socktype = engines[i].socktype;
+            return (engines[i].loop);
+        }
+    }
+    return (NULL);
+}
+
+/* 使い方の表示 */
+static void
+usage(void)
+{
+    (void) fprintf(stderr, "server [-d] [-e blocking|epoll|uring|splice|zcrecv|udp|shm] [-h host] [-H] [-l err|info|debug] [-L accesslog] [-M adminport] [-S statsname] [-t threads | -p procs | -a loops [-A acceptors]] [-m maxline] [-w workers] [-W usec] [-Z bytes] port|unix:path\n");
 }
 
 int
 main(int argc, char* argv[])
 {
-    int soc;
+    const char *engine = "epoll", *hostnm = NULL, *admin = NULL, *stats = NULL;
+    loop_func loop;
+    int soc, socktype, ch, nthreads = -1, nprocs = 0, nloops = 0, nacceptors = 1, dflag = 0, hflag = 0;
+    int level = LOG_LEVEL_DEBUG;
+    /* オプションの解析 */
+    // -e で送受信エンジンを選択する（デフォルトはepoll）
+    // -h で待ち受けるホスト名orIPアドレスを指定する
+    // ポートの代わりに unix:パス を指定するとUnixドメインソケットで待ち受ける
+    // -t でSO_REUSEPORTによるスレッド数を指定する（0ならCPU数）
+    // -p で事前forkするワーカープロセス数を指定する
+    // -d でデーモン化する
+    // -w で要求処理スレッド数を指定する（epollのみ）
+    // -a で専用acceptスレッドから接続を受け取るepollループ数を指定する
+    // -A でその専用acceptスレッド数を指定する
+    // -W で応答をまとめて送るために待つ最大時間（マイクロ秒）を指定する（epollのみ）
+    // -m で要求1行の最大長を指定する（受信バッファはこの長さまで広がる）
+    // -Z でこのバイト数以上の応答をMSG_ZEROCOPYで送る（blocking,epollのみ）
+    // -H で接続ごとの状態とバッファをヒュージページから確保する
+    // -L で接続ごとの記録を追記するバイナリのアクセスログのファイルを指定する
+    // -l でログレベルを指定する（実行中もSIGUSR1で詳しく、SIGUSR2で簡潔にできる）
+    // -M で統計をテキストで返す管理用のポートを指定する
+    // -S で統計を書き出す共有メモリの名前を指定する（npstatで読む）
+    g_opt.max_line = REQ_MAX_LINE;
+    while ((ch = getopt(argc, argv, "a:A:de:h:Hl:L:m:M:p:S:t:w:W:Z:")) != -1) {
+        switch (ch) {
+        case 'a':
+            nloops = atoi(optarg);
+            break;
+        case 'A':
+            nacceptors = atoi(optarg);
+            break;
+        case 'd':
+            dflag = 1;
+            break;
+        case 'L':
+            g_opt.access_log = optarg;
+            break;
+        case 'm':
+            g_opt.max_line = (size_t) atol(optarg);
+            break;
+        case 'M':
+            admin = optarg;
+            break;
+        case 'p':
+            nprocs = atoi(optarg);
+            break;
+        case 'S':
+            stats = optarg;
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'h':
+            hostnm = optarg;
+            break;
+        case 'H':
+            hflag = 1;
+            break;
+        case 'l':
+            if ((level = log_level_parse(optarg)) == -1) {
+                (void) fprintf(stderr, "unknown log level:%s\n", optarg);
+                usage();
+                return (EX_USAGE);
+            }
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'w':
+            g_opt.nworkers = atoi(optarg);
+            break;
+        case 'W':
+            g_opt.flush_usec = atoi(optarg);
+            break;
+        case 'Z':
+            g_opt.zc_min = (size_t) atol(optarg);
+            break;
+        default:
+            usage();
+            return (EX_USAGE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
     /* 引数にポート番号が指定されているか？ */
     if (argc <= 0) {
-        (void) fprintf(stderr, "server port\n");
+        usage();
+        return (EX_USAGE);
+    }
+    if ((loop = find_engine(engine, &socktype)) == NULL) {
+        (void) fprintf(stderr, "unknown engine:%s\n", engine);
+        usage();
+        return (EX_USAGE);
+    }
+    if (g_opt.max_line == 0 || g_opt.max_line > REQ_MAX_LINE_LIMIT) {
+        (void) fprintf(stderr, "-m must be 1..%d\n", REQ_MAX_LINE_LIMIT);
+        return (EX_USAGE);
+    }
+    if ((nthreads >= 0) + (nprocs > 0) + (nloops > 0) > 1) {
+        (void) fprintf(stderr, "-t, -p and -a are exclusive\n");
+        return (EX_USAGE);
+    }
+    if (nloops > 0 && loop != epoll_loop) {
+        (void) fprintf(stderr, "-a requires the epoll engine\n");
+        return (EX_USAGE);
+    }
+    // 使わないエンジンで指定されても黙って無視されるだけなので受け付けない
+    if ((g_opt.nworkers > 0 || g_opt.flush_usec > 0) && loop != epoll_loop) {
+        (void) fprintf(stderr, "-w and -W require the epoll engine\n");
+        return (EX_USAGE);
+    }
+    if (g_opt.zc_min > 0 && loop != epoll_loop && loop != accept_loop) {
+        (void) fprintf(stderr, "-Z requires the blocking or epoll engine\n");
+        return (EX_USAGE);
+    }
+    if (loop == shm_loop && strncmp(argv[0], UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) != 0) {
+        // セグメントのfdはUnixドメインソケットでしか渡せない
+        (void) fprintf(stderr, "-e shm requires a %s path\n", UNIX_PREFIX);
+        return (EX_USAGE);
+    }
+    if (dflag && strncmp(argv[0], UNIX_PREFIX "/", sizeof(UNIX_PREFIX)) != 0
+            && strncmp(argv[0], UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0) {
+        // デーモン化で/に移動するので相対パスでは別の場所になる
+        (void) fprintf(stderr, "-d requires an absolute %s path\n", UNIX_PREFIX);
+        return (EX_USAGE);
+    }
+    if (admin != NULL && nprocs > 0) {
+        // 統計はプロセスごとに持つので、1つのプロセスの管理用ポートでは全体を返せない
+        // ワーカーごとの統計は-Sの共有メモリに書き出し、npstatで合計する
+        (void) fprintf(stderr, "-M cannot be combined with -p (use -S)\n");
+        return (EX_USAGE);
+    }
+    if (stats != NULL && nprocs > STATSHM_SLOTS) {
+        // ワーカー番号ごとにスロットを使うので、足りなければ一部のワーカーの統計が抜ける
+        (void) fprintf(stderr, "-S supports at most %d procs\n", STATSHM_SLOTS);
+        return (EX_USAGE);
+    }
+    if (dflag && g_opt.access_log != NULL && g_opt.access_log[0] != '/') {
+        (void) fprintf(stderr, "-d requires an absolute -L path\n");
         return (EX_USAGE);
     }
+    // スレッドやワーカーを作る前に決めておく
+    slab_init(hflag);
+    /* デーモン化 */
+    // 待ち受けソケットもクローズされるので作成より先に行う
+    if (dflag && daemonize(0, 0) == -1) {
+        perror("daemonize");
+        return (EX_OSERR);
+    }
+    /* 非同期ログの開始 */
+    // 書き出しスレッドもデーモン化の後で作る
+    (void) log_init(level);
+    /* アクセスログを開く */
+    // デーモン化でディスクリプタが閉じられるのでその後で開く
+    if (g_opt.access_log != NULL && accesslog_open(g_opt.access_log) == -1) {
+        return (EX_CANTCREAT);
+    }
+    /* 管理用ポートの開始 */
+    // 送受信のループとは別のスレッドで、全スレッドの統計を合計して返す
+    if (admin != NULL && admin_serve(hostnm, admin) == -1) {
+        return (EX_UNAVAILABLE);
+    }
+    /* 統計の共有メモリの作成 */
+    // 事前forkならワーカーが起動時に自分のスロットを使い、それ以外はこのプロセスが0番を使う
+    if (stats != NULL) {
+        if (statshm_create(stats) == -1) {
+            return (EX_CANTCREAT);
+        }
+        if (nprocs == 0 && statshm_attach(0) == -1) {
+            return (EX_OSERR);
+        }
+    }
+    if (nthreads >= 0) {
+        /* スレッドごとに待ち受けソケットを持つシャーディング */
+        if (shard_main(hostnm, argv[0], socktype, nthreads, loop) == -1) {
+            return (EX_UNAVAILABLE);
+        }
+        return (EX_OK);
+    }
     /* サーバーソケットの準備 */
-    if((soc = server_socket(argv[1])) == -1) {
-        (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
+    if((soc = server_socket_by_hostname(hostnm, argv[0], socktype, 0)) == -1) {
+        (void) fprintf(stderr, "server_socket(%s):error\n", argv[0]);
         return (EX_UNAVAILABLE);
     }
+    if (nloops > 0) {
+        /* 専用acceptスレッドからepollループへ受け渡す */
+        (void) acceptor_main(soc, nloops, nacceptors);
+        (void) close(soc);
+        return (EX_OK);
+    }
+    if (nprocs > 0) {
+        /* 待ち受けソケットを共有する事前fork型のワーカー */
+        (void) prefork_main(soc, nprocs, loop);
+        (void) close(soc);
+        return (EX_OK);
+    }
     (void) fprintf(stderr, "ready for accept\n");
-    /* アクセプトループ */
-    accept_loop(soc);
+    /* 送受信ループ */
+    loop(soc);
     /* ソケットクローズ */
-    // 実際はaccept_loopがCtrl+Cしないと止まらないのでここには到達しない
+    // 実際はループがCtrl+Cしないと止まらないのでここには到達しない
     (void) close(soc);
     return (EX_OK);
 }
-
@@ -0,0 +1,92 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* 応答文字列の接尾辞 */
+#define RESP_SUFFIX ":OK\r\b"
+/* 要求1行の最大長の既定値（これより長い行は区切って扱う） */
+#define REQ_MAX_LINE 65535
+/* -mで指定できる要求1行の最大長の上限 */
+#define REQ_MAX_LINE_LIMIT (16 * 1024 * 1024)
+/* 接続ごとの受信バッファの初期サイズ（長い行が来たら最大長まで広げる） */
+#define REQ_BUF_INIT 256
+/* この接頭辞で始まるポートはUnixドメインソケットのパス（例 unix:/tmp/server.sock） */
+#define UNIX_PREFIX "unix:"
+/* peer_nameで作る文字列の最大長（数値のIPv6アドレスとポート、またはunix:とパス） */
+#define PEER_NAME_MAX 128
+/* 応答1つを表すiovecの要素数（要求の行と接尾辞） */
+#define RESP_IOV 2
+
+/* 起動オプション */
+struct server_opt {
+    int nworkers;   // 要求処理スレッド数（0ならI/Oスレッドで処理する）
+    int flush_usec; // 応答をまとめて送るために待つ最大時間（0なら待たない）
+    size_t max_line;    // 要求1行の最大長
+    size_t zc_min;      // MSG_ZEROCOPYで送る応答の合計バイト数の下限（0なら使わない）
+    const char *access_log; // アクセスログのファイル（NULLなら記録しない）
+};
+extern struct server_opt g_opt;
+
+/* 送受信エンジン（待ち受けソケットを受け取って処理し続けるループ） */
+typedef void (*loop_func)(int soc);
+
+/* server.c */
+int server_socket(const char *portnm);
+int server_socket_by_hostname(const char *hostnm, const char *portnm, int socktype, int reuseport);
+loop_func find_engine(const char *name, int *socktype);
+struct sockaddr;
+void peer_name(const struct sockaddr *sa, socklen_t len, char *buf, size_t size);
+struct access_info;
+void accept_serve(int soc, void (*serve)(int acc, struct access_info *ai));
+void accept_loop(int soc);
+void send_recv_loop(int acc, struct access_info *ai);
+int set_block(int fd, int flag);
+
+/* response.c */
+struct iovec;
+struct framer;
+int line_response_iov(const char *line, size_t len, struct iovec *iov);
+int request_response_iov(struct framer *f, const char *req, size_t len, struct iovec *iov);
+size_t mystrlcat(char *dst, const char *src, size_t size);
+
+/* server_epoll.c */
+struct mpsc;
+void epoll_loop(int soc);
+void epoll_loop_inbox(int soc, struct mpsc *inbox);
+
+/* server_uring.c */
+void uring_loop(int soc);
+
+/* server_splice.c */
+void splice_echo(int acc, struct access_info *ai);
+void splice_loop(int soc);
+
+/* server_zcrecv.c */
+void zcrecv_echo(int acc, struct access_info *ai);
+void zcrecv_loop(int soc);
+
+/* server_udp.c */
+void udp_loop(int soc);
+
+/* server_shm.c */
+void shm_serve(int acc, struct access_info *ai);
+void shm_loop(int soc);
+
+/* server_shard.c */
+int shard_main(const char *hostnm, const char *portnm, int socktype, int nthreads, loop_func loop);
+
+/* server_acceptor.c */
+int acceptor_main(int soc, int nloops, int nacceptors);
+
+/* ../chapter03/daemon.c */
+int daemonize(int nochdir, int noclose);
+
+/* server_prefork.c */
+int prefork_main(int soc, int nprocs, loop_func loop);
+
+/* admin.c */
+int admin_serve(const char *hostnm, const char *portnm);
+
+#endif
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "mpsc.h"
+
+/* 受け渡しリングの容量 */
+#define INBOX_SIZE 4096
+/* ディスクリプタ不足などでacceptに失敗し続けるときに待つ時間（マイクロ秒） */
+#define ACCEPT_BACKOFF_USEC 10000
+
+/* acceptスレッドとI/Oスレッドの共有情報 */
+struct acceptor {
+    int soc;
+    int nloops;
+    struct mpsc *inboxes;
+};
+
+/* I/Oスレッドの引数 */
+struct io_arg {
+    struct mpsc *inbox;
+};
+
+/* I/Oスレッド */
+static void *
+io_thread(void *arg)
+{
+    struct io_arg *a = arg;
+
+    // 自分ではacceptせず受け渡された接続だけを扱う
+    epoll_loop_inbox(-1, a->inbox);
+    return (NULL);
+}
+
+/* acceptスレッド */
+// ブロッキングでacceptし、I/Oスレッドに順番に受け渡す
+static void *
+acceptor_thread(void *arg)
+{
+    struct acceptor *ac = arg;
+    struct handoff h;
+    unsigned next = 0;
+    int i;
+
+    for (;;) {
+        h.len = (socklen_t) sizeof(h.from);
+        if ((h.fd = accept4(ac->soc, (struct sockaddr *) &h.from, &h.len,
+                        SOCK_NONBLOCK)) == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // 接続は待ち行列に残ったままなので、すぐ再試行しても同じエラーで空回りする
+                // I/Oスレッドが接続を閉じてディスクリプタが空くまで少し待つ
+                (void) usleep(ACCEPT_BACKOFF_USEC);
+            }
+            continue;
+        }
+        /* 受け渡し */
+        // 満杯なら次のI/Oスレッドに回し、全部満杯なら切断する
+        for (i = 0; i < ac->nloops; i++) {
+            if (mpsc_push(&ac->inboxes[next++ % (unsigned) ac->nloops], &h) == 0) {
+                break;
+            }
+        }
+        if (i == ac->nloops) {
+            (void) fprintf(stderr, "acceptor:all inboxes full\n");
+            (void) close(h.fd);
+        }
+    }
+    return (NULL);
+}
+
+/* 専用acceptスレッドとI/Oスレッド群 */
+// nacceptors個のacceptスレッドが、nloops個のepollループへ
+// ロックなしのリングで接続を受け渡す
+int
+acceptor_main(int soc, int nloops, int nacceptors)
+{
+    struct acceptor ac;
+    struct io_arg *args;
+    pthread_t tid;
+    int i, err;
+
+    if (nloops <= 0) {
+        nloops = 1;
+    }
+    if (nacceptors <= 0) {
+        nacceptors = 1;
+    }
+    if ((ac.inboxes = calloc((size_t) nloops, sizeof(*ac.inboxes))) == NULL
+            || (args = calloc((size_t) nloops, sizeof(*args))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    ac.soc = soc;
+    ac.nloops = nloops;
+    /* I/Oスレッドの起動 */
+    for (i = 0; i < nloops; i++) {
+        if (mpsc_init(&ac.inboxes[i], INBOX_SIZE) == -1) {
+            return (-1);
+        }
+        args[i].inbox = &ac.inboxes[i];
+        if ((err = pthread_create(&tid, NULL, io_thread, &args[i])) != 0) {
+            (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+            return (-1);
+        }
+        (void) pthread_detach(tid);
+    }
+    /* acceptスレッドの起動 */
+    // 1つはこのスレッド自身が受け持つ
+    for (i = 1; i < nacceptors; i++) {
+        if ((err = pthread_create(&tid, NULL, acceptor_thread, &ac)) != 0) {
+            (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+            return (-1);
+        }
+        (void) pthread_detach(tid);
+    }
+    (void) fprintf(stderr, "ready for accept (%d acceptors, %d loops)\n",
+                    nacceptors, nloops);
+    (void) acceptor_thread(&ac);
+    return (0);
+}
@@ -0,0 +1,885 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "pool.h"
+#include "mpsc.h"
+#include "framer.h"
+#include "slab.h"
+#include "outq.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+
+/* 一度に受け取るイベントの最大数 */
+#define MAX_EVENTS 256
+/* 受け渡しリングから一度に取り出す接続の最大数 */
+#define MAX_HANDOFF 64
+/* 送信待ちがこれを超えたら猶予を待たずに送る */
+#define FLUSH_BYTES 2048
+/* 1回の起床でこれ以上の要求を処理したら混んでいるとみなす */
+#define BUSY_REQS 8
+/* 猶予を広げ始めるときの初期値（ナノ秒） */
+#define WINDOW_MIN 10000
+/* 接続表の要素数の上限（RLIMIT_NOFILEがこれより大きくてもここまで） */
+#define CONN_TABLE_MAX (1024 * 1024)
+
+/* 接続ごとの受信バッファと送信待ち */
+// 要求処理スレッドにも渡すので、接続表とは別にslabから確保する
+struct conn_io {
+    int fd;
+    // 要求処理スレッドに渡している間はI/Oスレッドはバッファに触らない
+    struct task task;
+    // 要求処理スレッドで処理した要求数
+    unsigned ndone;
+    // 受信したバイト数と処理した要求数（切断時にアクセスログへ）
+    uint64_t bytes_in;
+    unsigned long nreq;
+    // 応答を送りきっていない要求の数と、そのうち最初の受信の時刻（サービス時間用）
+    unsigned pending;
+    uint64_t recv_ns;
+    // 受信データを行に区切るフレーマー（受信バッファを持つ）
+    struct framer in;
+    // 送信待ちの応答（受信バッファの中の要求の行と接尾辞を指す）
+    struct outq out;
+};
+
+/* 接続ごとの送受信状態のうちイベントごとに触る部分 */
+// fdで引く接続表に並べ、1要素を1キャッシュラインに収める
+struct conn {
+    int fd;
+    // 送信待ちが一杯で受信を止めているか
+    uint8_t rblocked;
+    // 相手が送信を終えたので、残りの応答を送りきったらクローズする
+    uint8_t eof;
+    // 要求処理スレッドに渡している
+    uint8_t busy;
+    // 処理中にクローズされたので完了時に閉じて解放する
+    uint8_t dead;
+    // クローズ済みでゼロコピー送信の完了を待っている（fdとバッファを残している）
+    uint8_t linger;
+    // 要求処理中に届いたゼロコピー送信の完了通知を、処理の完了後に受け取る
+    uint8_t reap;
+    // 送信の猶予中の接続のリンク（fd、-1で終端）と送信期限（ナノ秒）
+    uint8_t dirty;
+    int dnext, dprev;
+    uint64_t deadline;
+    // 受信バッファと送信待ち（NULLなら空き）
+    struct conn_io *io;
+} __attribute__((aligned(64)));
+
+/* 接続ごとのめったに使わない情報 */
+// 受付と切断のときだけ触るので、接続表とは別の配列に置く
+// 相手のアドレスはsockaddrのまま持ち、ログに出すときだけ文字列にする
+struct conn_cold {
+    struct access_info access;  // 相手のアドレスとアクセスログの記録
+};
+
+/* ループごとの状態 */
+struct ev_loop {
+    int epfd;
+    int soc;                // 待ち受けソケット（-1なら受け渡しのみ）
+    struct mpsc *inbox;     // acceptスレッドからの受け渡しリング
+    struct task_done done;  // 要求処理スレッドからの完了通知
+    // 送信の猶予中の接続（fd、-1なら空）
+    int dirty;
+    // 現在の送信の猶予とその上限（ナノ秒）
+    uint64_t window, max_window;
+    // 今回の起床で処理した要求数
+    unsigned nreq;
+};
+
+/* 要求処理スレッドプール（プロセスで共有） */
+static struct pool *g_pool;
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+/* fdで引く接続表（プロセスで共有） */
+// fdはプロセス内で重ならず、1つの接続は1つのループだけが触るのでロックはいらない
+// 表は動かさないので、要素へのポインタはクローズまで使える
+static struct conn *g_conns;
+static struct conn_cold *g_cold;
+static int g_nconns;
+static pthread_once_t g_conns_once = PTHREAD_ONCE_INIT;
+
+/* スレッドプールの作成 */
+// 事前forkではfork後の各プロセスで作る必要があるので最初のループ開始時に作る
+static void
+pool_init_once(void)
+{
+    if (g_opt.nworkers > 0 && (g_pool = pool_create(g_opt.nworkers)) == NULL) {
+        (void) fprintf(stderr, "pool_create:error\n");
+    }
+}
+
+/* 接続表の作成 */
+// 開けるfdの数だけ確保するが、触った要素のページしか実メモリは使わない
+static void
+conn_table_init_once(void)
+{
+    struct rlimit rl;
+    size_t n = CONN_TABLE_MAX;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < n) {
+        n = (size_t) rl.rlim_cur;
+    }
+    g_conns = mmap(NULL, n * sizeof(*g_conns), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    g_cold = mmap(NULL, n * sizeof(*g_cold), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (g_conns == MAP_FAILED || g_cold == MAP_FAILED) {
+        perror("mmap");
+        if (g_conns != MAP_FAILED) {
+            (void) munmap(g_conns, n * sizeof(*g_conns));
+        }
+        if (g_cold != MAP_FAILED) {
+            (void) munmap(g_cold, n * sizeof(*g_cold));
+        }
+        g_conns = NULL;
+        g_cold = NULL;
+        return;
+    }
+    g_nconns = (int) n;
+}
+
+/* 現在時刻（ナノ秒） */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec);
+}
+
+/* 送信の猶予中リストへの追加 */
+// 期限は最初に溜まった応答から数える
+static void
+dirty_add(struct ev_loop *lp, struct conn *c)
+{
+    if (c->dirty) {
+        return;
+    }
+    c->dirty = 1;
+    c->deadline = now_ns() + lp->window;
+    c->dprev = -1;
+    c->dnext = lp->dirty;
+    if (lp->dirty != -1) {
+        g_conns[lp->dirty].dprev = c->fd;
+    }
+    lp->dirty = c->fd;
+}
+
+/* 送信の猶予中リストからの削除 */
+static void
+dirty_del(struct ev_loop *lp, struct conn *c)
+{
+    if (!c->dirty) {
+        return;
+    }
+    c->dirty = 0;
+    if (c->dprev != -1) {
+        g_conns[c->dprev].dnext = c->dnext;
+    } else {
+        lp->dirty = c->dnext;
+    }
+    if (c->dnext != -1) {
+        g_conns[c->dnext].dprev = c->dprev;
+    }
+}
+
+/* fdとバッファの解放 */
+// fdを閉じてから表の要素を空きにする
+static void
+conn_release(struct conn *c)
+{
+    (void) close(c->fd);
+    framer_free(&c->io->in);
+    slab_free(c->io, sizeof(*c->io));
+    c->io = NULL;
+}
+
+/* ゼロコピー送信の完了待ち */
+// 送ったページをカーネルがまだ参照しているので、バッファをslabに返すと
+// 別の接続のデータが相手に届きうる
+// closeすると完了通知を受け取れないので、fdも残してEPOLLERRで通知を待つ
+static void
+conn_linger(struct ev_loop *lp, struct conn *c)
+{
+    struct epoll_event ev;
+
+    c->dead = 1;
+    c->linger = 1;
+    // 関心イベントなしでもEPOLLERRとEPOLLHUPは通知される
+    ev.events = EPOLLET;
+    ev.data.fd = c->fd;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        // 完了が分からないので、fdだけ閉じてバッファは解放しない
+        (void) close(c->fd);
+        c->io = NULL;
+    }
+}
+
+/* クローズ済みの接続の完了通知の受け取り */
+// 全部完了したら解放し、通知を読めなければバッファを手放したままfdだけ閉じる
+static void
+conn_linger_reap(struct ev_loop *lp, struct conn *c)
+{
+    if (outq_reap(c->fd, &c->io->out) == -1) {
+        (void) close(c->fd);
+        c->io = NULL;
+        return;
+    }
+    if (outq_idle(&c->io->out)) {
+        (void) epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        conn_release(c);
+    }
+}
+
+/* 接続の解放 */
+// ゼロコピー送信の完了待ちが残っていれば、fdとバッファの解放はその完了後
+static void
+conn_free(struct ev_loop *lp, struct conn *c)
+{
+    struct conn_cold *cc = &g_cold[c->fd];
+    char peer[PEER_NAME_MAX];
+
+    cc->access.bytes_in = c->io->bytes_in;
+    cc->access.bytes_out = c->io->out.sent;
+    cc->access.requests = c->io->nreq;
+    if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+        peer_name((struct sockaddr *) &cc->access.from, cc->access.fromlen, peer, sizeof(peer));
+        LOG(LOG_LEVEL_INFO, "close:%s requests=%lu\n", peer, cc->access.requests);
+    }
+    access_end(&cc->access);
+    metrics_add(M_CLOSES, 1);
+    // 送っていない応答は捨て、カーネルに渡したゼロコピー送信だけを待つ
+    outq_discard(&c->io->out);
+    if (!outq_idle(&c->io->out)) {
+        conn_linger(lp, c);
+        return;
+    }
+    conn_release(c);
+}
+
+/* 切断の理由の記録 */
+// 相手のEOFで閉じるとき以外に呼ぶ
+static void
+conn_reason(struct conn *c, int reason)
+{
+    g_cold[c->fd].access.reason = reason;
+}
+
+/* 接続のクローズ */
+static void
+conn_close(struct ev_loop *lp, struct conn *c)
+{
+    dirty_del(lp, c);
+    // closeすればepollからも外れるが明示的に削除しておく
+    (void) epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->busy) {
+        // 要求処理スレッドが使っているので完了時に閉じる
+        // それまではfdを閉じず、同じ番号が別の接続に使われないようにする
+        c->dead = 1;
+        return;
+    }
+    conn_free(lp, c);
+}
+
+/* 応答を追加する余地があるか */
+static int
+conn_room(struct conn_io *io)
+{
+    return (outq_room(&io->out) >= RESP_IOV);
+}
+
+/* 溜まっている要求の処理 */
+// 送信待ちに応答が入る間、取り出せる行をすべて処理し、処理数を返す
+// 応答は受信バッファを直接指すので、送り終えるまでフレーマーに保持させる
+static unsigned
+conn_process(struct conn_io *io)
+{
+    struct iovec iov[RESP_IOV];
+    const char *line;
+    size_t len;
+    unsigned n = 0;
+
+    while (conn_room(io) && framer_next(&io->in, &line, &len)) {
+        LOG(LOG_LEVEL_DEBUG, "[client]%.*s\n", (int) len, line);
+        (void) outq_pushv(&io->out, iov, request_response_iov(&io->in, line, len, iov));
+        framer_hold(&io->in);
+        n++;
+    }
+    return (n);
+}
+
+/* 要求処理（要求処理スレッドで実行） */
+// 接続表には触らず、受信バッファと送信待ちだけを使う
+static void
+conn_task_run(struct task *t)
+{
+    struct conn_io *io = (struct conn_io *) ((char *) t - offsetof(struct conn_io, task));
+
+    io->ndone = conn_process(io);
+}
+
+/* 処理した要求数の反映 */
+static void
+conn_count(struct ev_loop *lp, struct conn *c, unsigned n)
+{
+    if (n > 0) {
+        lp->nreq += n;
+        c->io->nreq += n;
+        if (c->io->recv_ns == 0) {
+            // 前の応答を送り終える前に受信していた要求は処理を終えた時点から数える
+            c->io->recv_ns = now_ns();
+        }
+        c->io->pending += n;
+        metrics_add(M_REQUESTS, n);
+    }
+}
+
+/* 送信待ちデータの送信 */
+// 応答を送りきったら、それまでの要求のサービス時間を記録する
+// 0:送信できるところまで送った -1:エラー
+static int
+conn_flush(struct conn *c)
+{
+    struct conn_io *io = c->io;
+    size_t sent = io->out.sent;
+
+    if (outq_flush(c->fd, &io->out) == -1) {
+        metrics_add(M_SEND_ERRORS, 1);
+        conn_reason(c, ACCESS_ERROR);
+        return (-1);
+    }
+    metrics_add(M_BYTES_OUT, io->out.sent - sent);
+    if (io->out.bytes == 0 && io->pending > 0) {
+        metrics_service(now_ns() - io->recv_ns, io->pending);
+        io->pending = 0;
+        io->recv_ns = 0;
+    }
+    if (outq_idle(&c->io->out)) {
+        // 受信バッファを詰めてよい
+        framer_release(&c->io->in);
+    }
+    return (0);
+}
+
+/* ゼロコピー送信の完了通知の受け取り */
+// エラーキューに通知が届くとEPOLLERRになる
+// 0:継続 -1:ソケットのエラー
+static int
+conn_reap(struct conn *c)
+{
+    if (outq_reap(c->fd, &c->io->out) == -1) {
+        conn_reason(c, ACCESS_ERROR);
+        return (-1);
+    }
+    if (outq_idle(&c->io->out)) {
+        // 完了待ちで止めていた受信バッファを詰めてよい
+        framer_release(&c->io->in);
+    }
+    return (0);
+}
+
+/* 受信と要求処理 */
+// 応答は送信の猶予中リストに載せ、起床の最後にまとめて送る
+// 0:継続 -1:切断
+static int
+conn_read(struct ev_loop *lp, struct conn *c)
+{
+    struct conn_io *io = c->io;
+    ssize_t len;
+    size_t avail;
+    char *ptr;
+
+    // エッジトリガなのでEAGAINになるまで読み切る
+    for (;;) {
+        // 要求処理中なら完了してから続きを読む
+        if (c->busy) {
+            return (0);
+        }
+        /* 要求処理 */
+        // 1回の起床で受信済みの行をまとめて処理する
+        if (g_pool == NULL) {
+            conn_count(lp, c, conn_process(io));
+        } else if (conn_room(io) && framer_ready(&io->in)) {
+            // 要求処理スレッドに渡し、完了通知で続きを行う
+            c->busy = 1;
+            pool_submit(g_pool, &io->task);
+            return (0);
+        }
+        // 送信待ちに応答が入らなければ送ってから続ける
+        if (!conn_room(io)) {
+            if (conn_flush(c) == -1) {
+                return (-1);
+            }
+            if (!conn_room(io)) {
+                c->rblocked = 1;
+                return (0);
+            }
+            continue;
+        }
+        c->rblocked = 0;
+        if (c->eof) {
+            break;
+        }
+        /* 受信 */
+        // 前回の受信で残った行の途中に続けて受信する
+        if ((ptr = framer_space(&io->in, &avail)) == NULL) {
+            // これ以上は受信せず、送信待ちの応答を送ってから閉じる
+            conn_reason(c, ACCESS_REJECT);
+            c->eof = 1;
+            continue;
+        }
+        if (avail == 0) {
+            // 受信バッファが送信待ちの応答に使われているので送ってから続ける
+            if (conn_flush(c) == -1) {
+                return (-1);
+            }
+            if (!outq_idle(&io->out)) {
+                c->rblocked = 1;
+                return (0);
+            }
+            continue;
+        }
+        if ((len = recv(c->fd, ptr, avail, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("recv");
+            metrics_add(M_RECV_ERRORS, 1);
+            conn_reason(c, ACCESS_ERROR);
+            return (-1);
+        }
+        if (len == 0) {
+            /* EOF */
+            // 残りの要求を処理してから閉じる
+            LOG(LOG_LEVEL_INFO, "recv:EOF\n");
+            c->eof = 1;
+            framer_eof(&io->in);
+            continue;
+        }
+        framer_commit(&io->in, (size_t) len);
+        io->bytes_in += (uint64_t) len;
+        metrics_add(M_BYTES_IN, (uint64_t) len);
+        if (io->recv_ns == 0) {
+            // 猶予中に溜めた分も含め、応答を送りきるまでを数える
+            io->recv_ns = now_ns();
+        }
+    }
+    if (c->eof) {
+        // これ以上応答は増えないので猶予なしで送る
+        dirty_del(lp, c);
+        if (conn_flush(c) == -1) {
+            return (-1);
+        }
+        return (outq_idle(&io->out) ? -1 : 0);
+    }
+    if (io->out.bytes > 0) {
+        dirty_add(lp, c);
+    }
+    return (0);
+}
+
+/* 送信の猶予中の接続の送信 */
+// 期限が来たものと溜まりすぎたものを送り、次の期限までの時間を返す（-1:なし）
+static int64_t
+flush_dirty(struct ev_loop *lp)
+{
+    struct conn *c;
+    uint64_t now, first = 0;
+    int fd, next;
+
+    now = now_ns();
+    for (fd = lp->dirty; fd != -1; fd = next) {
+        c = &g_conns[fd];
+        next = c->dnext;
+        if (c->busy) {
+            // 要求処理スレッドが送信待ちに追加しているので完了後に載せ直す
+            dirty_del(lp, c);
+            continue;
+        }
+        if (lp->window == 0 || now >= c->deadline
+                || c->io->out.bytes >= FLUSH_BYTES || outq_room(&c->io->out) == 0) {
+            dirty_del(lp, c);
+            if (conn_flush(c) == -1) {
+                conn_close(lp, c);
+                continue;
+            }
+            // 溜めていた応答を送り終えたら長い行で広げたバッファを戻す
+            framer_shrink(&c->io->in);
+            continue;
+        }
+        if (first == 0 || c->deadline < first) {
+            first = c->deadline;
+        }
+    }
+    return (first == 0 ? -1 : (int64_t) (first - now));
+}
+
+/* 送信の猶予の調整 */
+// 1回の起床で多くの要求を処理するほど猶予を広げてまとめて送り、
+// 空いてきたら猶予を縮めて応答の遅延を抑える
+static void
+adapt_window(struct ev_loop *lp)
+{
+    if (lp->max_window == 0) {
+        return;
+    }
+    if (lp->nreq >= BUSY_REQS) {
+        lp->window = lp->window == 0 ? WINDOW_MIN : lp->window * 2;
+        if (lp->window > lp->max_window) {
+            lp->window = lp->max_window;
+        }
+    } else if (lp->nreq <= 1) {
+        lp->window /= 2;
+        if (lp->window < WINDOW_MIN) {
+            lp->window = 0;
+        }
+    }
+    lp->nreq = 0;
+}
+
+/* 接続の登録 */
+// 接続表のfdの位置に状態を置き、epollにもfdで登録する
+static void
+conn_add(struct ev_loop *lp, int acc, struct sockaddr_storage *from, socklen_t len)
+{
+    char peer[PEER_NAME_MAX];
+    struct epoll_event ev;
+    struct conn_cold *cc;
+    struct conn_io *io;
+    struct conn *c;
+
+    if (acc >= g_nconns) {
+        LOG(LOG_LEVEL_ERR, "accept:fd %d exceeds the connection table\n", acc);
+        (void) close(acc);
+        return;
+    }
+    cc = &g_cold[acc];
+    access_begin(&cc->access, (struct sockaddr *) from, len);
+    if (LOG_ENABLED(LOG_LEVEL_INFO)) {
+        peer_name((struct sockaddr *) from, len, peer, sizeof(peer));
+        LOG(LOG_LEVEL_INFO, "accept:%s\n", peer);
+    }
+    if ((io = slab_zalloc(sizeof(*io))) == NULL) {
+        perror("slab_zalloc");
+        (void) close(acc);
+        return;
+    }
+    io->fd = acc;
+    if (framer_init(&io->in, REQ_BUF_INIT, g_opt.max_line) == -1) {
+        (void) close(acc);
+        slab_free(io, sizeof(*io));
+        return;
+    }
+    outq_init(&io->out);
+    outq_zerocopy(acc, &io->out, g_opt.zc_min);
+    io->task.run = conn_task_run;
+    io->task.done = &lp->done;
+    c = &g_conns[acc];
+    (void) memset(c, 0, sizeof(*c));
+    c->fd = acc;
+    c->dnext = c->dprev = -1;
+    c->io = io;
+    metrics_add(M_ACCEPTS, 1);
+    /* 受信・送信可能をエッジトリガで監視 */
+    // EPOLLOUTは送信バッファが空いた変化時のみ通知される
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = acc;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+        perror("epoll_ctl");
+        conn_free(lp, c);
+    }
+}
+
+/* 新規接続の受付 */
+// エッジトリガなのでEAGAINになるまでacceptする
+static void
+accept_all(struct ev_loop *lp)
+{
+    struct sockaddr_storage from;
+    socklen_t len;
+    int acc;
+
+    for (;;) {
+        len = (socklen_t) sizeof(from);
+        if ((acc = accept4(lp->soc, (struct sockaddr *) &from, &len,
+                        SOCK_NONBLOCK)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // EMFILEなどは次のイベントで再試行する
+                perror("accept");
+            }
+            return;
+        }
+        conn_add(lp, acc, &from, len);
+    }
+}
+
+/* acceptスレッドから受け渡された接続の登録 */
+// 1回の起床でまとめて取り出す
+static void
+handoff_all(struct ev_loop *lp)
+{
+    struct handoff hs[MAX_HANDOFF];
+    size_t n, i;
+
+    while ((n = mpsc_pop_batch(lp->inbox, hs, MAX_HANDOFF)) > 0) {
+        for (i = 0; i < n; i++) {
+            conn_add(lp, hs[i].fd, &hs[i].from, hs[i].len);
+        }
+    }
+}
+
+/* 要求処理スレッドからの完了の受け取り */
+static void
+done_all(struct ev_loop *lp)
+{
+    struct task *t, *next;
+    struct conn_io *io;
+    struct conn *c;
+
+    for (t = task_done_take(&lp->done); t != NULL; t = next) {
+        next = t->next;
+        io = (struct conn_io *) ((char *) t - offsetof(struct conn_io, task));
+        c = &g_conns[io->fd];
+        c->busy = 0;
+        conn_count(lp, c, io->ndone);
+        if (c->dead) {
+            conn_free(lp, c);
+            continue;
+        }
+        // エッジトリガなので、処理中に見送った完了通知はここで受け取る
+        if (c->reap) {
+            c->reap = 0;
+            if (conn_reap(c) == -1) {
+                conn_close(lp, c);
+                continue;
+            }
+        }
+        // 応答は送信待ちに入っているので、止めていた受信の続きと送信
+        if (conn_read(lp, c) == -1) {
+            conn_close(lp, c);
+        }
+    }
+}
+
+/* ループの準備 */
+// 0:成功 -1:エラー
+static int
+loop_init(struct ev_loop *lp, int soc, struct mpsc *inbox)
+{
+    struct epoll_event ev;
+
+    (void) memset(lp, 0, sizeof(*lp));
+    lp->soc = soc;
+    lp->inbox = inbox;
+    lp->dirty = -1;
+    lp->done.efd = -1;
+    lp->max_window = (uint64_t) (g_opt.flush_usec > 0 ? g_opt.flush_usec : 0) * 1000;
+    if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return (-1);
+    }
+    if (soc != -1) {
+        /* 待ち受けソケットもノンブロッキングにする */
+        if (set_block(soc, 0) == -1) {
+            return (-1);
+        }
+        // 接続と同じくfdで区別する
+        // 複数プロセスで共有しているときはEPOLLEXCLUSIVEで1つだけ起こす
+        ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        ev.data.fd = soc;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+            perror("epoll_ctl");
+            return (-1);
+        }
+    }
+    /* 受け渡しリングのドアベル */
+    if (inbox != NULL) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = inbox->efd;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, inbox->efd, &ev) == -1) {
+            perror("epoll_ctl");
+            return (-1);
+        }
+    }
+    /* 要求処理スレッドからの完了通知 */
+    if (g_pool != NULL) {
+        if (task_done_init(&lp->done) == -1) {
+            return (-1);
+        }
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = lp->done.efd;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->done.efd, &ev) == -1) {
+            perror("epoll_ctl");
+            (void) close(lp->done.efd);
+            lp->done.efd = -1;
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/* epollによる多重化ループ */
+// 1スレッドで待ち受けソケットと複数の接続を同時に扱う
+void
+epoll_loop(int soc)
+{
+    epoll_loop_inbox(soc, NULL);
+}
+
+/* epollによる多重化ループ（受け渡しリング付き） */
+// socが-1なら自分ではacceptせず、inboxに届いた接続だけを扱う
+void
+epoll_loop_inbox(int soc, struct mpsc *inbox)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct ev_loop loop, *lp = &loop;
+    struct timespec ts, *tsp;
+    struct conn *c;
+    int64_t wait_ns = -1;
+    int nready, i, rung, fd;
+
+    (void) pthread_once(&g_pool_once, pool_init_once);
+    (void) pthread_once(&g_conns_once, conn_table_init_once);
+    if (g_conns == NULL) {
+        return;
+    }
+
+    if (loop_init(lp, soc, inbox) == -1) {
+        if (lp->epfd != -1) {
+            (void) close(lp->epfd);
+        }
+        return;
+    }
+    for (;;) {
+        /* 待ち時間 */
+        // 送信の猶予中の接続があれば一番近い期限まで
+        // 受け渡しリングに残りがあれば眠らずにイベントだけ見る
+        tsp = NULL;
+        if (wait_ns >= 0) {
+            ts.tv_sec = (time_t) (wait_ns / 1000000000);
+            ts.tv_nsec = (long) (wait_ns % 1000000000);
+            tsp = &ts;
+        }
+        if (inbox != NULL && !mpsc_prepare_sleep(inbox)) {
+            ts.tv_sec = ts.tv_nsec = 0;
+            tsp = &ts;
+        }
+        // 猶予はマイクロ秒単位なのでナノ秒で待てるepoll_pwait2を使う
+        nready = epoll_pwait2(lp->epfd, events, MAX_EVENTS, tsp, NULL);
+        if (inbox != NULL) {
+            rung = 0;
+            for (i = 0; i < nready; i++) {
+                if (events[i].data.fd == inbox->efd) {
+                    rung = 1;
+                }
+            }
+            mpsc_wake(inbox, rung);
+            /* 受け渡された接続の登録 */
+            handoff_all(lp);
+        }
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_pwait2");
+            }
+            nready = 0;
+        }
+        for (i = 0; i < nready; i++) {
+            fd = events[i].data.fd;
+            if (inbox != NULL && fd == inbox->efd) {
+                continue;
+            }
+            if (fd == lp->soc) {
+                /* 接続受付 */
+                accept_all(lp);
+                continue;
+            }
+            if (fd == lp->done.efd) {
+                /* 要求処理の完了 */
+                done_all(lp);
+                continue;
+            }
+            if ((c = &g_conns[fd])->io == NULL) {
+                // 閉じた接続に残っていたイベント
+                continue;
+            }
+            if (c->linger) {
+                /* クローズ済みの接続のゼロコピー送信の完了 */
+                conn_linger_reap(lp, c);
+                continue;
+            }
+            if (c->dead) {
+                continue;
+            }
+            // 要求処理スレッドが送信待ちと受信バッファを使っている間は、
+            // 完了通知を受け取らずに処理の完了後に回す
+            if ((events[i].events & EPOLLERR) && c->busy) {
+                c->reap = 1;
+            }
+            if ((events[i].events & EPOLLHUP)
+                    || ((events[i].events & EPOLLERR) && !c->busy && conn_reap(c) == -1)) {
+                if (!c->eof) {
+                    conn_reason(c, ACCESS_ERROR);
+                }
+                conn_close(lp, c);
+                continue;
+            }
+            /* 送信可能 */
+            // 要求処理スレッドが送信待ちを使っている間は完了時に送る
+            // 猶予中の応答は期限まで溜めておく
+            if ((events[i].events & EPOLLOUT) && !c->busy && !c->dirty) {
+                if (conn_flush(c) == -1) {
+                    conn_close(lp, c);
+                    continue;
+                }
+                framer_shrink(&c->io->in);
+            }
+            if (c->eof && !c->rblocked) {
+                // 受信は終わっているので送信の続きだけ
+                if (outq_idle(&c->io->out) && !c->busy) {
+                    conn_close(lp, c);
+                }
+                continue;
+            }
+            /* 受信可能 */
+            // 送信待ちで止めていた受信もここで再開する
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) || c->rblocked) {
+                if (conn_read(lp, c) == -1) {
+                    conn_close(lp, c);
+                    continue;
+                }
+            }
+        }
+        /* 送信の猶予の調整と期限が来た応答の送信 */
+        adapt_window(lp);
+        wait_ns = flush_dirty(lp);
+    }
+}
@@ -0,0 +1,140 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "statshm.h"
+
+/* 短時間で異常終了を繰り返すワーカーの再起動間隔（秒） */
+#define RESPAWN_DELAY 1
+
+/* 終了シグナルを受けたか */
+static volatile sig_atomic_t g_stop;
+
+/* 終了シグナルハンドラ */
+static void
+sig_term_handler(int sig)
+{
+    (void) sig;
+    g_stop = 1;
+}
+
+/* ワーカープロセスの起動 */
+// 子プロセスは待ち受けソケットを継承してそのままループに入る
+static pid_t
+spawn_worker(int soc, int id, loop_func loop)
+{
+    struct sigaction sa;
+    pid_t pid;
+
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        return (-1);
+    }
+    if (pid != 0) {
+        /* 親プロセス */
+        return (pid);
+    }
+    /* ワーカープロセス */
+    // 親のシグナルハンドラは引き継がない
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) sigaction(SIGINT, &sa, NULL);
+    // 統計はワーカー番号のスロットに書き、再起動されても同じスロットに足し込む
+    // 書き出せないまま数えずに動くより、終了してマスターに起動し直させる
+    if (statshm_attach(id) == -1) {
+        _exit(1);
+    }
+    (void) fprintf(stderr, "worker %d:pid=%d ready for accept\n", id, (int) getpid());
+    /* 送受信ループ */
+    // accept時の起こしすぎはepollならEPOLLEXCLUSIVE、ブロッキングならacceptの中の
+    // カーネルの排他的な待ち合わせで1プロセスだけが起こされる
+    // io_uringはカーネルのworkerで待つので、全プロセスが起こされうる
+    loop(soc);
+    _exit(0);
+}
+
+/* 事前fork型のワーカープロセスプール */
+// マスタープロセスはワーカーを監視し、終了したものを起動し直す
+int
+prefork_main(int soc, int nprocs, loop_func loop)
+{
+    struct sigaction sa;
+    pid_t *pids, pid;
+    time_t *started;
+    int i, status;
+
+    if ((pids = calloc((size_t) nprocs, sizeof(*pids))) == NULL
+            || (started = calloc((size_t) nprocs, sizeof(*started))) == NULL) {
+        perror("calloc");
+        free(pids);
+        return (-1);
+    }
+    /* 終了シグナルで全ワーカーを止める */
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_term_handler;
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) sigaction(SIGINT, &sa, NULL);
+    /* ワーカーの起動 */
+    for (i = 0; i < nprocs; i++) {
+        started[i] = time(NULL);
+        pids[i] = spawn_worker(soc, i, loop);
+    }
+    /* ワーカーの監視 */
+    while (!g_stop) {
+        if ((pid = waitpid(-1, &status, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ECHILD) {
+                perror("waitpid");
+                break;
+            }
+            // fork失敗などでワーカーがいなければ間をおいて起動し直す
+            (void) sleep(RESPAWN_DELAY);
+        }
+        for (i = 0; i < nprocs; i++) {
+            if (pid == -1 || pids[i] != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                (void) fprintf(stderr, "worker %d:pid=%d killed by signal %d\n",
+                                i, (int) pid, WTERMSIG(status));
+            } else {
+                (void) fprintf(stderr, "worker %d:pid=%d exit %d\n",
+                                i, (int) pid, WEXITSTATUS(status));
+            }
+            pids[i] = -1;
+        }
+        /* 止まっているワーカーの再起動 */
+        for (i = 0; i < nprocs && !g_stop; i++) {
+            if (pids[i] != -1) {
+                continue;
+            }
+            // 起動直後に落ち続けるなら少し待って再起動の嵐を防ぐ
+            if (time(NULL) - started[i] < RESPAWN_DELAY) {
+                (void) sleep(RESPAWN_DELAY);
+            }
+            started[i] = time(NULL);
+            pids[i] = spawn_worker(soc, i, loop);
+        }
+    }
+    /* 全ワーカーの停止 */
+    for (i = 0; i < nprocs; i++) {
+        if (pids[i] > 0) {
+            (void) kill(pids[i], SIGTERM);
+        }
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+    free(started);
+    free(pids);
+    return (0);
+}
@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/* ワーカースレッドごとの情報 */
+struct shard {
+    pthread_t tid;
+    int id;
+    int cpu;        // 固定するCPU（-1なら固定しない）
+    int soc;        // このスレッド専用の待ち受けソケット
+    loop_func loop;
+};
+
+/* ワーカースレッド */
+static void *
+shard_thread(void *arg)
+{
+    struct shard *sh = arg;
+    cpu_set_t set;
+    int err;
+
+    /* CPUへの固定 */
+    // 1スレッド1コアにして他のスレッドと何も共有しない
+    if (sh->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(sh->cpu, &set);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+            (void) fprintf(stderr, "pthread_setaffinity_np:%s\n", strerror(err));
+        }
+    }
+    (void) fprintf(stderr, "shard %d:cpu=%d ready for accept\n", sh->id, sh->cpu);
+    /* 送受信ループ */
+    sh->loop(sh->soc);
+    (void) close(sh->soc);
+    return (NULL);
+}
+
+/* SO_REUSEPORTによるスレッドごとのシャーディング */
+// スレッドごとに待ち受けソケットを作り、接続の振り分けはカーネルに任せる
+// nthreadsが0なら利用可能なCPU数だけスレッドを作る
+int
+shard_main(const char *hostnm, const char *portnm, int socktype, int nthreads, loop_func loop)
+{
+    struct shard *shards;
+    cpu_set_t avail;
+    int cpus[CPU_SETSIZE], ncpu, i, err;
+
+    /* 利用可能なCPUの一覧 */
+    ncpu = 0;
+    if (sched_getaffinity(0, sizeof(avail), &avail) == 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &avail)) {
+                cpus[ncpu++] = i;
+            }
+        }
+    } else {
+        perror("sched_getaffinity");
+    }
+    if (nthreads <= 0) {
+        nthreads = ncpu > 0 ? ncpu : 1;
+    }
+    if ((shards = calloc((size_t) nthreads, sizeof(*shards))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    /* スレッドごとのサーバーソケットの準備 */
+    // 全部作れなければ起動しない
+    for (i = 0; i < nthreads; i++) {
+        shards[i].id = i;
+        shards[i].cpu = ncpu > 0 ? cpus[i % ncpu] : -1;
+        shards[i].loop = loop;
+        if ((shards[i].soc = server_socket_by_hostname(hostnm, portnm, socktype, 1)) == -1) {
+            (void) fprintf(stderr, "server_socket(%s):error\n", portnm);
+            while (--i >= 0) {
+                (void) close(shards[i].soc);
+            }
+            free(shards);
+            return (-1);
+        }
+    }
+    /* ワーカースレッドの起動 */
+    for (i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&shards[i].tid, NULL, shard_thread, &shards[i])) != 0) {
+            (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+            (void) close(shards[i].soc);
+            shards[i].soc = -1;
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (shards[i].soc != -1) {
+            (void) pthread_join(shards[i].tid, NULL);
+        }
+    }
+    free(shards);
+    return (0);
+}
@@ -0,0 +1,164 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "framer.h"
+#include "shmring.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+
+/* 相手の生存を確かめる間隔（ミリ秒） */
+// リングが空のまま眠るときのfutexのタイムアウト
+#define SHM_POLL_MS 100
+
+/* 応答のリングへの書き込み */
+// 満杯なら空くまで待つ
+// 0:すべて書いた -1:相手がいないかリングが壊れている
+static int
+shm_put(struct shmseg *seg, int acc, const struct iovec *iov, int cnt)
+{
+    const char *p;
+    size_t len;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        p = iov[i].iov_base;
+        len = iov[i].iov_len;
+        while (len > 0) {
+            if (shmring_closed(&seg->resp)) {
+                return (-1);
+            }
+            if ((n = shmring_write(&seg->resp, p, len)) == -1) {
+                LOG(LOG_LEVEL_ERR, "shm:broken ring\n");
+                return (-1);
+            }
+            if (n == 0) {
+                if (!shmring_wait_space(&seg->resp, SHM_POLL_MS) && shmseg_peer_gone(acc)) {
+                    return (-1);
+                }
+                continue;
+            }
+            p += n;
+            len -= (size_t) n;
+        }
+    }
+    return (0);
+}
+
+/* 共有メモリのリングによる送受信 */
+// 接続ごとにセグメントを作ってソケットでfdを渡し、以降の要求と応答はリングだけでやりとりする
+// 要求の処理はsend_recv_loopと同じ（フレーマーで区切って接尾辞を付ける）
+// ソケットは相手の異常終了に気付くためだけにつないでおく
+void
+shm_serve(int acc, struct access_info *ai)
+{
+    const char *line;
+    char *ptr;
+    struct shmseg *seg;
+    struct framer in;
+    struct iovec iov[RESP_IOV];
+    size_t len, avail;
+    ssize_t n;
+    uint64_t start, out;
+    unsigned long nreq;
+    int fd, eof, closed, cnt;
+
+    ai->reason = ACCESS_ERROR;
+    if ((seg = shmseg_create(&fd)) == NULL) {
+        return;
+    }
+    if (shmseg_send(acc, fd) == -1) {
+        (void) close(fd);
+        shmseg_unmap(seg);
+        return;
+    }
+    (void) close(fd);
+    if (framer_init(&in, REQ_BUF_INIT, g_opt.max_line) == -1) {
+        shmseg_unmap(seg);
+        return;
+    }
+    ai->reason = ACCESS_EOF;
+    for (eof = 0; !eof;) {
+        /* 受信 */
+        // 前回の受信で残った行の途中に続けてリングから取り出す
+        if ((ptr = framer_space(&in, &avail)) == NULL) {
+            ai->reason = ACCESS_REJECT;
+            break;
+        }
+        // 閉じたかどうかは読む前に見ておき、閉じる直前に書かれた分を取りこぼさない
+        closed = shmring_closed(&seg->req);
+        if ((n = shmring_read(&seg->req, ptr, avail)) == -1) {
+            // クライアントが位置を壊したので、これ以上リングを信用せずに閉じる
+            LOG(LOG_LEVEL_ERR, "shm:broken ring\n");
+            metrics_add(M_RECV_ERRORS, 1);
+            ai->reason = ACCESS_REJECT;
+            break;
+        }
+        if (n == 0) {
+            if (closed) {
+                /* EOF */
+                // 改行のない最後の行も処理してから抜ける
+                LOG(LOG_LEVEL_INFO, "recv:EOF\n");
+                framer_eof(&in);
+                eof = 1;
+            } else {
+                // リングが空なら相手が書くまで眠る
+                if (!shmring_wait_data(&seg->req, SHM_POLL_MS) && shmseg_peer_gone(acc)) {
+                    LOG(LOG_LEVEL_INFO, "shm:peer gone\n");
+                    ai->reason = ACCESS_ERROR;
+                    break;
+                }
+                continue;
+            }
+        } else {
+            framer_commit(&in, (size_t) n);
+            ai->bytes_in += (uint64_t) n;
+            metrics_add(M_BYTES_IN, (uint64_t) n);
+        }
+        /* 要求処理 */
+        // 応答は受信バッファを指すiovecを作り、そのままリングへコピーする
+        // サービス時間はリングから取り出してから応答を書き終えるまで
+        start = metrics_now();
+        out = ai->bytes_out;
+        nreq = 0;
+        while (framer_next(&in, &line, &len)) {
+            LOG(LOG_LEVEL_DEBUG, "[client]%.*s\n", (int) len, line);
+            cnt = request_response_iov(&in, line, len, iov);
+            if (shm_put(seg, acc, iov, cnt) == -1) {
+                metrics_add(M_SEND_ERRORS, 1);
+                ai->reason = ACCESS_ERROR;
+                eof = 1;
+                break;
+            }
+            ai->bytes_out += iov[0].iov_len + (cnt > 1 ? iov[1].iov_len : 0);
+            nreq++;
+        }
+        ai->requests += nreq;
+        metrics_add(M_REQUESTS, nreq);
+        metrics_add(M_BYTES_OUT, ai->bytes_out - out);
+        if (ai->reason != ACCESS_ERROR) {
+            metrics_service(metrics_now() - start, nreq);
+        }
+        // 長い行で広げたバッファは次の受信を待つ間に戻しておく
+        framer_shrink(&in);
+    }
+    /* 応答の終わり */
+    // 相手は読み終えたらソケットを閉じる
+    shmring_close(&seg->resp);
+    shmring_close(&seg->req);
+    framer_free(&in);
+    shmseg_unmap(seg);
+}
+
+/* 共有メモリのリングによる送受信のループ */
+// unix:のソケットで接続を受け付け、1接続ずつ処理するので並列に扱うには-pと組み合わせる
+void
+shm_loop(int soc)
+{
+    accept_serve(soc, shm_serve);
+}
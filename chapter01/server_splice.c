@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+
+/* 1回のspliceで移す最大バイト数 */
+#define SPLICE_CHUNK (1024 * 1024)
+/* 中継パイプの容量（設定できなければ既定の64KBのまま使う） */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/* パイプに移した分の送信（パイプ→ソケット） */
+// 0:すべて送った -1:エラー
+static int
+splice_out(int pfd, int acc, size_t n)
+{
+    ssize_t m;
+
+    while (n > 0) {
+        if ((m = splice(pfd, NULL, acc, NULL, n, SPLICE_F_MOVE)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice");
+            return (-1);
+        }
+        n -= (size_t) m;
+    }
+    return (0);
+}
+
+/* spliceによるエコー */
+// 受信データを ソケット→パイプ→ソケット とカーネル内で移すだけで、
+// ユーザー空間には読み込まない（":OK"の接尾辞も付けない）
+// 行を区切らないので、1回のspliceで受信した分を1要求として数える
+void
+splice_echo(int acc, struct access_info *ai)
+{
+    ssize_t n;
+    uint64_t start;
+    int p[2];
+
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return;
+    }
+    (void) fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    for (;;) {
+        /* 受信（ソケット→パイプ） */
+        if ((n = splice(acc, NULL, p[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice");
+            metrics_add(M_RECV_ERRORS, 1);
+            ai->reason = ACCESS_ERROR;
+            break;
+        }
+        if (n == 0) {
+            /* EOF */
+            LOG(LOG_LEVEL_INFO, "recv:EOF\n");
+            break;
+        }
+        start = metrics_now();
+        ai->bytes_in += (uint64_t) n;
+        ai->requests++;
+        metrics_add(M_BYTES_IN, (uint64_t) n);
+        metrics_add(M_REQUESTS, 1);
+        if (splice_out(p[0], acc, (size_t) n) == -1) {
+            metrics_add(M_SEND_ERRORS, 1);
+            ai->reason = ACCESS_ERROR;
+            break;
+        }
+        metrics_service(metrics_now() - start, 1);
+        ai->bytes_out += (uint64_t) n;
+        metrics_add(M_BYTES_OUT, (uint64_t) n);
+    }
+    (void) close(p[0]);
+    (void) close(p[1]);
+}
+
+/* spliceによるエコーのループ */
+// 1接続ずつ処理するのはblockingと同じで、並列に扱うには-tや-pと組み合わせる
+void
+splice_loop(int soc)
+{
+    accept_serve(soc, splice_echo);
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+#include "log.h"
+#include "metrics.h"
+
+/* 1回のrecvmmsgで受け取る最大メッセージ数 */
+#define UDP_BATCH 32
+/* 受信バッファのサイズ（UDP_GROでまとめられたデータグラムも入る） */
+#define UDP_BUF_SIZE 65536
+/* 1回のsendmmsgで送る最大メッセージ数 */
+#define UDP_OUT_MAX 256
+/* 送信するメッセージ全体で使えるiovecの数 */
+#define UDP_IOV_MAX 1024
+/* UDP_SEGMENTで1回に送る最大セグメント数（カーネルのUDP_MAX_SEGMENTS） */
+#define UDP_MAX_SEGS 64
+/* 1つのUDPパケットで送れる最大ペイロード長（IPv4） */
+#define UDP_MAX_PAYLOAD 65507
+
+/* 補助データ（UDP_GROで受け取るサイズ、UDP_SEGMENTで渡すサイズ） */
+union udp_ctl {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+/* 受信と送信のまとめ */
+// 応答は受信バッファと送信元アドレスを指すだけなので、送り終えるまで次を受信しない
+struct udp_batch {
+    struct mmsghdr in[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH];
+    struct sockaddr_storage from[UDP_BATCH];
+    union udp_ctl in_ctl[UDP_BATCH];
+    char buf[UDP_BATCH][UDP_BUF_SIZE];
+    struct mmsghdr out[UDP_OUT_MAX];
+    struct iovec out_iov[UDP_IOV_MAX];
+    union udp_ctl out_ctl[UDP_OUT_MAX];
+    int nout, niov;     // 送信待ちのメッセージ数と使ったiovecの数
+    int gso;            // UDP_SEGMENTで送れる
+};
+
+/* UDP_GROでまとめられたデータグラム1つ分の長さ */
+// まとめられていなければ0
+static size_t
+udp_gro_size(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    int size;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            (void) memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return (size > 0 ? (size_t) size : 0);
+        }
+    }
+    return (0);
+}
+
+/* セグメントごとの送信 */
+// UDP_SEGMENTが使えなかったメッセージを応答1つずつに分けて送り直す
+static void
+udp_send_each(int soc, const struct msghdr *h)
+{
+    struct msghdr one;
+    ssize_t n;
+    size_t i;
+
+    for (i = 0; i < h->msg_iovlen; i += RESP_IOV) {
+        one = *h;
+        one.msg_iov = h->msg_iov + i;
+        one.msg_iovlen = RESP_IOV;
+        one.msg_control = NULL;
+        one.msg_controllen = 0;
+        if ((n = sendmsg(soc, &one, 0)) == -1) {
+            perror("sendmsg");
+            metrics_add(M_SEND_ERRORS, 1);
+        } else {
+            metrics_add(M_BYTES_OUT, (uint64_t) n);
+        }
+    }
+}
+
+/* 送信待ちのメッセージをまとめて送信 */
+static void
+udp_flush(int soc, struct udp_batch *b)
+{
+    struct msghdr *h;
+    uint64_t sent = 0;
+    int off, n, k;
+
+    off = 0;
+    while (off < b->nout) {
+        if ((n = sendmmsg(soc, &b->out[off], (unsigned) (b->nout - off), 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // 先頭のメッセージが送れなかったので、それだけ飛ばして続ける
+            h = &b->out[off].msg_hdr;
+            if (h->msg_controllen > 0
+                    && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+                // 送信先のデバイスがUDP_SEGMENTに対応していない
+                (void) fprintf(stderr, "udp:UDP_SEGMENT disabled\n");
+                b->gso = 0;
+                udp_send_each(soc, h);
+            } else {
+                perror("sendmmsg");
+                metrics_add(M_SEND_ERRORS, 1);
+            }
+            off++;
+            continue;
+        }
+        // 送れたメッセージのmsg_lenには送ったバイト数が入る
+        for (k = off; k < off + n; k++) {
+            sent += b->out[k].msg_len;
+        }
+        off += n;
+    }
+    metrics_add(M_BYTES_OUT, sent);
+    b->nout = 0;
+    b->niov = 0;
+}
+
+/* 受信したメッセージ1つ分の応答 */
+// データグラム1つが要求1つで、応答はデータグラムそのものと接尾辞（改行は探さない）
+// segはUDP_GROでまとめられたデータグラム1つ分の長さ
+// 同じ長さのデータグラムが続くならUDP_SEGMENTでまとめて送り、カーネルに分割させる
+// 応答したデータグラム（要求）の数を返す
+static size_t
+udp_reply(int soc, struct udp_batch *b, int i, size_t seg)
+{
+    static const size_t slen = sizeof(RESP_SUFFIX) - 1;
+    struct msghdr *h;
+    struct cmsghdr *cmsg;
+    const char *p;
+    size_t len, n, nseg, max, k, nreq = 0;
+    uint16_t size;
+
+    p = b->buf[i];
+    len = b->in[i].msg_len;
+    /* 1メッセージで送るセグメント数の上限 */
+    max = 1;
+    if (b->gso && seg < len) {
+        max = UDP_MAX_PAYLOAD / (seg + slen);
+        if (max > UDP_MAX_SEGS) {
+            max = UDP_MAX_SEGS;
+        }
+        if (max == 0) {
+            max = 1;
+        }
+    }
+    do {
+        nseg = len == 0 ? 1 : (len + seg - 1) / seg;
+        if (nseg > max) {
+            nseg = max;
+        }
+        if (b->nout == UDP_OUT_MAX || b->niov + (int) nseg * RESP_IOV > UDP_IOV_MAX) {
+            udp_flush(soc, b);
+        }
+        h = &b->out[b->nout].msg_hdr;
+        (void) memset(h, 0, sizeof(*h));
+        h->msg_name = &b->from[i];
+        h->msg_namelen = b->in[i].msg_hdr.msg_namelen;
+        h->msg_iov = &b->out_iov[b->niov];
+        for (k = 0; k < nseg; k++) {
+            n = len < seg ? len : seg;
+            b->niov += line_response_iov(p, n, &b->out_iov[b->niov]);
+            h->msg_iovlen += RESP_IOV;
+            p += n;
+            len -= n;
+        }
+        if (nseg > 1) {
+            /* UDP_SEGMENTの指定 */
+            // 最後のセグメントだけは短くてよい
+            h->msg_control = b->out_ctl[b->nout].buf;
+            h->msg_controllen = CMSG_SPACE(sizeof(size));
+            cmsg = CMSG_FIRSTHDR(h);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+            size = (uint16_t) (seg + slen);
+            (void) memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+        b->nout++;
+        nreq += nseg;
+    } while (len > 0);
+    return (nreq);
+}
+
+/* UDPの送受信ループ */
+// recvmmsgで複数のデータグラムを受け取り、応答をsendmmsgでまとめて送る
+// UDP_GROを有効にして、同じ送信元からの同じ長さのデータグラムは1メッセージで受け取る
+// 接続はないので、受け付けた数と閉じた数は数えない
+void
+udp_loop(int soc)
+{
+    struct udp_batch *b;
+    struct msghdr *h;
+    uint64_t start, nreq;
+    size_t seg;
+    int opt, n, i;
+
+    if ((b = calloc(1, sizeof(*b))) == NULL) {
+        perror("calloc");
+        return;
+    }
+    b->gso = 1;
+    opt = 1;
+    if (setsockopt(soc, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == -1) {
+        // まとめられないだけで、データグラムは1つずつ受け取れる
+        perror("setsockopt(UDP_GRO)");
+    }
+    for (;;) {
+        /* 受信 */
+        for (i = 0; i < UDP_BATCH; i++) {
+            h = &b->in[i].msg_hdr;
+            b->in_iov[i].iov_base = b->buf[i];
+            b->in_iov[i].iov_len = sizeof(b->buf[i]);
+            h->msg_name = &b->from[i];
+            h->msg_namelen = sizeof(b->from[i]);
+            h->msg_iov = &b->in_iov[i];
+            h->msg_iovlen = 1;
+            h->msg_control = b->in_ctl[i].buf;
+            h->msg_controllen = sizeof(b->in_ctl[i].buf);
+            h->msg_flags = 0;
+        }
+        // 1つ目が届くまでは待ち、あとは届いている分だけ受け取る
+        if ((n = recvmmsg(soc, b->in, UDP_BATCH, MSG_WAITFORONE, NULL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recvmmsg");
+            metrics_add(M_RECV_ERRORS, 1);
+            break;
+        }
+        // サービス時間は受信を終えてから応答をまとめて送り終えるまで
+        start = metrics_now();
+        /* 応答の作成 */
+        nreq = 0;
+        for (i = 0; i < n; i++) {
+            metrics_add(M_BYTES_IN, b->in[i].msg_len);
+            if (b->in[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                LOG(LOG_LEVEL_ERR, "udp:truncated datagram\n");
+                metrics_add(M_RECV_ERRORS, 1);
+                continue;
+            }
+            if ((seg = udp_gro_size(&b->in[i].msg_hdr)) == 0) {
+                seg = b->in[i].msg_len;
+            }
+            nreq += udp_reply(soc, b, i, seg);
+        }
+        /* 送信 */
+        udp_flush(soc, b);
+        metrics_add(M_REQUESTS, nreq);
+        metrics_service(metrics_now() - start, nreq);
+    }
+    free(b);
+}
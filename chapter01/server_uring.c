@@ -0,0 +1,743 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "framer.h"
+#include "slab.h"
+#include "outq.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+
+/* 投入キューのエントリ数 */
+#define SQ_ENTRIES 256
+/* 提供バッファの数（2のべき乗） */
+#define NBUF 4096
+/* 提供バッファ1つのサイズ */
+#define BUF_SIZE 512
+/* 提供バッファのグループID */
+#define BGID 0
+/* ディスクリプタ不足などでacceptに失敗したときに投入し直すまで待つ時間（マイクロ秒） */
+#define ACCEPT_BACKOFF_USEC 10000
+
+/* user_dataの下位ビットに入れる操作種別 */
+#define OP_ACCEPT 0
+#define OP_RECV   1
+#define OP_SEND   2
+#define OP_TIMER  3     // acceptを投入し直すまでのタイマー
+#define OP_MASK   3
+
+/* SQEを取れずに投入し直す操作 */
+#define REARM_RECV 1
+#define REARM_SEND 2
+
+/* io_uringの状態 */
+// liburingは使わずにシステムコールとmmapで直接扱う
+struct uring {
+    int fd;
+    // 投入キュー（SQ）
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes;
+    // 完了キュー（CQ）
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // 提供バッファリング
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+    // バッファごとの受信長と処理待ちFIFOのリンク
+    unsigned blen[NBUF];
+    int bnext[NBUF];
+    // バッファ不足で受信を止めている接続
+    struct uconn *wait_list;
+    // SQEを取れずに投入し直す接続と、投入し直すマルチショットaccept
+    struct uconn *rearm_list;
+    int rearm_accept;
+    // acceptを投入し直すまで待つ時間（タイマーの完了までカーネルが参照する）
+    struct __kernel_timespec backoff;
+};
+
+/* 接続ごとの状態 */
+struct uconn {
+    int fd;
+    // 完了待ちの操作数（recvとsend）
+    int refs;
+    // 受信終了後、溜まっている要求を処理して送りきったらクローズする
+    int closing;
+    // EOFを受信した（処理待ちをフレーマーに移し終えてから反映する）
+    int rdeof;
+    // 送信エラーなどで残りを捨ててクローズする
+    int error;
+    // 処理待ちの受信バッファIDのFIFO（空なら-1）と先頭の処理済みバイト数
+    int head, tail;
+    unsigned roff;
+    // バッファ不足で受信を待っている接続のリスト
+    struct uconn *next_wait;
+    int waiting;
+    // SQEを取れずに投入し直す操作（REARM_RECV|REARM_SEND）とそのリスト
+    struct uconn *next_rearm;
+    int rearm;
+    // 送信中か（送信中は送信待ちに追加しない）
+    int sending;
+    // 送信中のsendmsgに渡したヘッダ（完了まで保持する）
+    struct msghdr msg;
+    // 送信待ちの応答（フレーマーの受信バッファの中の要求の行と接尾辞を指す）
+    struct outq out;
+    struct framer in;
+    // アクセスログの記録
+    struct access_info access;
+    // 応答を送りきっていない要求の数と、そのうち最初の受信の時刻（サービス時間用）
+    unsigned pending;
+    uint64_t recv_ns;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return ((int) syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return ((int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                    flags, NULL, 0));
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return ((int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/* io_uringの初期化 */
+static int
+uring_init(struct uring *r)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_sz, cq_sz, br_sz;
+    char *sq_ptr, *cq_ptr;
+    int i;
+
+    (void) memset(&p, 0, sizeof(p));
+    // 完了処理は割り込みではなくio_uring_enter時にまとめて行わせる
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    if ((r->fd = sys_io_uring_setup(SQ_ENTRIES, &p)) == -1) {
+        // 古いカーネルではフラグなしで再試行
+        (void) memset(&p, 0, sizeof(p));
+        if ((r->fd = sys_io_uring_setup(SQ_ENTRIES, &p)) == -1) {
+            perror("io_uring_setup");
+            return (-1);
+        }
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        (void) fprintf(stderr, "io_uring:IORING_FEAT_SINGLE_MMAP not supported\n");
+        (void) close(r->fd);
+        return (-1);
+    }
+    /* SQとCQのリングをまとめてマップ */
+    sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_sz > sq_sz) {
+        sq_sz = cq_sz;
+    }
+    if ((sq_ptr = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd,
+                    IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(r->fd);
+        return (-1);
+    }
+    cq_ptr = sq_ptr;
+    r->sq_head = (unsigned *) (sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *) (cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+    if ((r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(r->fd);
+        return (-1);
+    }
+
+    /* 提供バッファリングの登録 */
+    // 受信時にカーネルがここから空きバッファを選ぶ
+    br_sz = NBUF * sizeof(struct io_uring_buf);
+    if ((r->br = mmap(NULL, br_sz, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(r->fd);
+        return (-1);
+    }
+    if ((r->bufs = malloc((size_t) NBUF * BUF_SIZE)) == NULL) {
+        perror("malloc");
+        (void) close(r->fd);
+        return (-1);
+    }
+    (void) memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) r->br;
+    reg.ring_entries = NBUF;
+    reg.bgid = BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register(PBUF_RING)");
+        (void) close(r->fd);
+        return (-1);
+    }
+    r->br_tail = 0;
+    for (i = 0; i < NBUF; i++) {
+        r->br->bufs[i].addr = (uint64_t) (uintptr_t) (r->bufs + (size_t) i * BUF_SIZE);
+        r->br->bufs[i].len = BUF_SIZE;
+        r->br->bufs[i].bid = (unsigned short) i;
+        r->bnext[i] = -1;
+    }
+    r->br_tail = NBUF;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    return (0);
+}
+
+/* 投入キューの反映とシステムコール */
+static int
+uring_submit(struct uring *r, unsigned wait_nr)
+{
+    unsigned submitted;
+    int ret;
+
+    submitted = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        ret = sys_io_uring_enter(r->fd, submitted, wait_nr,
+                        wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (ret == -1 && errno == EINTR) {
+            // 投入済みの分は再投入しない
+            submitted = 0;
+            continue;
+        }
+        return (ret);
+    }
+}
+
+/* 空きSQEの取得 */
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    // 満杯なら一度投入して空ける
+    while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+            >= r->sq_entries) {
+        if (uring_submit(r, 0) == -1) {
+            perror("io_uring_enter");
+            return (NULL);
+        }
+    }
+    idx = r->sqe_tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    (void) memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return (sqe);
+}
+
+/* 投入し直す操作の登録 */
+// SQEを取れなかった操作は、完了を処理してからループで投入し直す
+// 落としたままだと接続が受信も送信もしないまま残る
+static void
+rearm_add(struct uring *r, struct uconn *c, int op)
+{
+    if (c->rearm == 0) {
+        c->next_rearm = r->rearm_list;
+        r->rearm_list = c;
+    }
+    c->rearm |= op;
+}
+
+/* マルチショットacceptの投入 */
+static void
+prep_accept(struct uring *r, int soc)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        // 落とすと受け付けが止まるので次の周回で投入し直す
+        r->rearm_accept = 1;
+        return;
+    }
+    // 1つのSQEで接続ごとにCQEが返り続ける
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = soc;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/* 間をおいたマルチショットacceptの投入 */
+// ディスクリプタ不足ではすぐ投入し直しても同じエラーで空回りするので、
+// 接続が閉じてディスクリプタが空くまでタイマーで待ち、その完了で投入する
+static void
+prep_accept_later(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        r->rearm_accept = 1;
+        return;
+    }
+    r->backoff.tv_sec = 0;
+    r->backoff.tv_nsec = ACCEPT_BACKOFF_USEC * 1000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &r->backoff;
+    sqe->len = 1;
+    sqe->user_data = OP_TIMER;
+}
+
+/* マルチショットrecvの投入 */
+static void
+prep_recv(struct uring *r, struct uconn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        rearm_add(r, c, REARM_RECV);
+        return;
+    }
+    // 受信バッファは提供バッファリングからカーネルが選ぶ
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->user_data = (uint64_t) (uintptr_t) c | OP_RECV;
+    c->refs++;
+}
+
+/* 送信待ちの応答のsendmsgの投入 */
+// 送信待ちのiovecをそのまま渡し、完了するまでは送信待ちに手を付けない
+static void
+prep_send(struct uring *r, struct uconn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        rearm_add(r, c, REARM_SEND);
+        return;
+    }
+    (void) memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->out.iov + c->out.head;
+    c->msg.msg_iovlen = (size_t) c->out.cnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) c | OP_SEND;
+    c->refs++;
+    c->sending = 1;
+}
+
+/* SQEを取れなかった操作の投入し直し */
+// 投入し直しでもSQEを取れなければ、また次の周回に回る
+static void
+rearm_run(struct uring *r, int soc)
+{
+    struct uconn *c, *next;
+    int op;
+
+    if (r->rearm_accept) {
+        r->rearm_accept = 0;
+        prep_accept(r, soc);
+    }
+    c = r->rearm_list;
+    r->rearm_list = NULL;
+    for (; c != NULL; c = next) {
+        next = c->next_rearm;
+        op = c->rearm;
+        c->rearm = 0;
+        if ((op & REARM_RECV) && !c->closing && !c->waiting) {
+            prep_recv(r, c);
+        }
+        if ((op & REARM_SEND) && !c->sending && c->out.cnt > 0) {
+            prep_send(r, c);
+        }
+    }
+}
+
+/* 提供バッファの返却 */
+static void
+buf_recycle(struct uring *r, int bid)
+{
+    struct io_uring_buf *b;
+    struct uconn *c;
+
+    b = &r->br->bufs[r->br_tail & (NBUF - 1)];
+    b->addr = (uint64_t) (uintptr_t) (r->bufs + (size_t) bid * BUF_SIZE);
+    b->len = BUF_SIZE;
+    b->bid = (unsigned short) bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    /* バッファ不足で止まっていた受信を再開 */
+    while ((c = r->wait_list) != NULL) {
+        r->wait_list = c->next_wait;
+        c->waiting = 0;
+        if (!c->closing) {
+            prep_recv(r, c);
+        }
+    }
+}
+
+/* 処理待ちを破棄してバッファを返却 */
+static void
+drop_queue(struct uring *r, struct uconn *c)
+{
+    int bid;
+
+    while ((bid = c->head) != -1) {
+        c->head = r->bnext[bid];
+        buf_recycle(r, bid);
+    }
+    c->tail = -1;
+    c->roff = 0;
+}
+
+/* 受信データの要求処理 */
+// 処理待ちの受信バッファをフレーマーに移して取り出せる行をすべて処理し、
+// まとめて送信する
+// 応答はフレーマーの受信バッファを直接指すので、送り終えるまで保持させる
+static void
+conn_pump(struct uring *r, struct uconn *c)
+{
+    struct iovec iov[RESP_IOV];
+    const char *line;
+    char *p;
+    size_t len, avail, n;
+    int bid;
+
+    while (!c->error) {
+        /* 要求処理 */
+        // 送信中は送信待ちが動かせないので完了を待つ
+        while (!c->sending && outq_room(&c->out) >= RESP_IOV
+                && framer_next(&c->in, &line, &len)) {
+            LOG(LOG_LEVEL_DEBUG, "[client]%.*s\n", (int) len, line);
+            (void) outq_pushv(&c->out, iov, request_response_iov(&c->in, line, len, iov));
+            framer_hold(&c->in);
+            c->access.requests++;
+            if (c->recv_ns == 0) {
+                // 前の応答を送り終える前に受信していた要求は処理を始めた時点から数える
+                c->recv_ns = metrics_now();
+            }
+            c->pending++;
+            metrics_add(M_REQUESTS, 1);
+        }
+        /* 処理待ちの受信バッファをフレーマーへ */
+        if ((bid = c->head) == -1) {
+            if (c->rdeof && !c->in.eof) {
+                // 改行のない最後の行も取り出せるようにして処理し直す
+                framer_eof(&c->in);
+                continue;
+            }
+            break;
+        }
+        if ((p = framer_space(&c->in, &avail)) == NULL) {
+            // 受信を止め、送信待ちの応答を送ってから閉じる
+            c->access.reason = ACCESS_REJECT;
+            c->closing = 1;
+            drop_queue(r, c);
+            (void) shutdown(c->fd, SHUT_RD);
+            break;
+        }
+        if (avail == 0) {
+            // 送信完了で応答が参照していた分を詰めてから続ける
+            break;
+        }
+        n = r->blen[bid] - c->roff;
+        if (n > avail) {
+            n = avail;
+        }
+        (void) memcpy(p, r->bufs + (size_t) bid * BUF_SIZE + c->roff, n);
+        framer_commit(&c->in, n);
+        c->roff += (unsigned) n;
+        if (c->roff == r->blen[bid]) {
+            // 移し終えたバッファは受信用に返却
+            c->head = r->bnext[bid];
+            if (c->head == -1) {
+                c->tail = -1;
+            }
+            c->roff = 0;
+            buf_recycle(r, bid);
+        }
+    }
+    if (!c->sending && c->out.cnt > 0) {
+        prep_send(r, c);
+    }
+}
+
+/* 完了待ちがなくなった接続のクローズ */
+static void
+maybe_close(struct uring *r, struct uconn *c)
+{
+    struct uconn **pp;
+
+    if (!c->closing || c->refs > 0) {
+        return;
+    }
+    if (!c->error && (c->head != -1 || c->out.cnt > 0 || framer_ready(&c->in))) {
+        // 残りの要求と応答を処理しきってから閉じる
+        return;
+    }
+    drop_queue(r, c);
+    if (c->waiting) {
+        for (pp = &r->wait_list; *pp != NULL; pp = &(*pp)->next_wait) {
+            if (*pp == c) {
+                *pp = c->next_wait;
+                break;
+            }
+        }
+    }
+    if (c->rearm) {
+        for (pp = &r->rearm_list; *pp != NULL; pp = &(*pp)->next_rearm) {
+            if (*pp == c) {
+                *pp = c->next_rearm;
+                break;
+            }
+        }
+    }
+    (void) close(c->fd);
+    c->access.bytes_out = c->out.sent;
+    access_end(&c->access);
+    metrics_add(M_CLOSES, 1);
+    framer_free(&c->in);
+    slab_free(c, sizeof(*c));
+}
+
+/* accept完了 */
+static void
+on_accept(struct uring *r, int soc, struct io_uring_cqe *cqe)
+{
+    char peer[PEER_NAME_MAX];
+    struct sockaddr_storage from;
+    struct uconn *c;
+    socklen_t len;
+
+    // マルチショットが終了していれば再投入
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -EMFILE || cqe->res == -ENFILE
+                || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+            prep_accept_later(r);
+        } else {
+            prep_accept(r, soc);
+        }
+    }
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("accept");
+        return;
+    }
+    // マルチショットではアドレスを受け取れないので後から取得するが、
+    // ログにもアクセスログにも使わないならシステムコールを省く
+    len = 0;
+    if (LOG_ENABLED(LOG_LEVEL_INFO) || accesslog_enabled()) {
+        len = (socklen_t) sizeof(from);
+        if (getpeername(cqe->res, (struct sockaddr *) &from, &len) == -1) {
+            len = 0;
+        }
+        if (len > 0 && LOG_ENABLED(LOG_LEVEL_INFO)) {
+            peer_name((struct sockaddr *) &from, len, peer, sizeof(peer));
+            LOG(LOG_LEVEL_INFO, "accept:%s\n", peer);
+        }
+    }
+    if ((c = slab_zalloc(sizeof(*c))) == NULL) {
+        perror("slab_zalloc");
+        (void) close(cqe->res);
+        return;
+    }
+    c->fd = cqe->res;
+    c->head = c->tail = -1;
+    access_begin(&c->access, (struct sockaddr *) &from, len);
+    outq_init(&c->out);
+    if (framer_init(&c->in, REQ_BUF_INIT, g_opt.max_line) == -1) {
+        (void) close(c->fd);
+        slab_free(c, sizeof(*c));
+        return;
+    }
+    metrics_add(M_ACCEPTS, 1);
+    prep_recv(r, c);
+}
+
+/* recv完了 */
+static void
+on_recv(struct uring *r, struct uconn *c, struct io_uring_cqe *cqe)
+{
+    int bid;
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        r->blen[bid] = (unsigned) cqe->res;
+        r->bnext[bid] = -1;
+        c->access.bytes_in += (uint64_t) cqe->res;
+        metrics_add(M_BYTES_IN, (uint64_t) cqe->res);
+        if (c->recv_ns == 0) {
+            c->recv_ns = metrics_now();
+        }
+        if (c->error) {
+            buf_recycle(r, bid);
+        } else {
+            // 受信順を保つため処理待ちFIFOの後ろにつなぐ
+            if (c->head == -1) {
+                c->head = bid;
+            } else {
+                r->bnext[c->tail] = bid;
+            }
+            c->tail = bid;
+            conn_pump(r, c);
+        }
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
+    /* マルチショット終了 */
+    c->refs--;
+    if (cqe->res == -ENOBUFS) {
+        // バッファが返却されたら再投入する
+        if (!c->waiting) {
+            c->waiting = 1;
+            c->next_wait = r->wait_list;
+            r->wait_list = c;
+        }
+    } else if (cqe->res == 0) {
+        /* EOF */
+        // 改行のない最後の行も処理してから閉じる
+        LOG(LOG_LEVEL_INFO, "recv:EOF\n");
+        c->closing = 1;
+        c->rdeof = 1;
+        conn_pump(r, c);
+    } else if (cqe->res < 0) {
+        /* エラー */
+        errno = -cqe->res;
+        perror("recv");
+        metrics_add(M_RECV_ERRORS, 1);
+        c->access.reason = ACCESS_ERROR;
+        c->closing = 1;
+    } else if (!c->closing) {
+        prep_recv(r, c);
+    }
+    maybe_close(r, c);
+}
+
+/* send完了 */
+static void
+on_send(struct uring *r, struct uconn *c, struct io_uring_cqe *cqe)
+{
+    c->refs--;
+    c->sending = 0;
+    if (cqe->res < 0) {
+        /* エラー */
+        errno = -cqe->res;
+        perror("send");
+        metrics_add(M_SEND_ERRORS, 1);
+        c->access.reason = ACCESS_ERROR;
+        c->closing = 1;
+        c->error = 1;
+        maybe_close(r, c);
+        return;
+    }
+    /* 送信済みの分を外す */
+    outq_consume(&c->out, (size_t) cqe->res);
+    metrics_add(M_BYTES_OUT, (uint64_t) cqe->res);
+    if (c->out.cnt == 0 && c->pending > 0) {
+        // 応答を送りきったら、それまでの要求のサービス時間を記録する
+        metrics_service(metrics_now() - c->recv_ns, c->pending);
+        c->pending = 0;
+        c->recv_ns = 0;
+    }
+    if (c->out.cnt == 0) {
+        // 受信バッファを詰めてよい
+        framer_release(&c->in);
+    }
+    // 空いた分で処理待ちの要求を処理して送る
+    conn_pump(r, c);
+    if (!c->sending && c->head == -1) {
+        // 処理待ちがなくなったら長い行で広げたバッファを戻す
+        framer_shrink(&c->in);
+    }
+    maybe_close(r, c);
+}
+
+/* io_uringによる完了ベースのループ */
+// accept/recv/sendをすべて非同期に投入し、完了をまとめて処理する
+void
+uring_loop(int soc)
+{
+    struct uring *r;
+    struct io_uring_cqe *cqe;
+    struct uconn *c;
+    unsigned head, tail;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+        perror("calloc");
+        return;
+    }
+    if (uring_init(r) == -1) {
+        free(r);
+        return;
+    }
+    prep_accept(r, soc);
+    for (;;) {
+        // 投入と完了待ちを1回のシステムコールで行う
+        if (uring_submit(r, 1) == -1 && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &r->cqes[head & *r->cq_mask];
+            c = (struct uconn *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+            switch (cqe->user_data & OP_MASK) {
+            case OP_ACCEPT:
+                on_accept(r, soc, cqe);
+                break;
+            case OP_RECV:
+                on_recv(r, c, cqe);
+                break;
+            case OP_SEND:
+                on_send(r, c, cqe);
+                break;
+            case OP_TIMER:
+                // 待ち終えたのでacceptを投入し直す
+                prep_accept(r, soc);
+                break;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        // 完了を刈り取ってSQとCQが空いたところで投入し直す
+        rearm_run(r, soc);
+    }
+    (void) close(r->fd);
+    free(r->bufs);
+    free(r);
+}
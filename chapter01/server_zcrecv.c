@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "log.h"
+#include "accesslog.h"
+#include "metrics.h"
+
+/* 受信データをマップする領域のサイズ（ページサイズの倍数） */
+#define ZC_MAP_SIZE (2 * 1024 * 1024)
+/* ページに揃わない端数をコピーで受信するバッファのサイズ */
+#define ZC_COPY_SIZE 65536
+
+/* 送り返した分の計上 */
+// 行を区切らないので、1回の受信で送り返した分を1要求として数える
+static void
+echo_count(struct access_info *ai, size_t n, uint64_t start)
+{
+    ai->requests++;
+    metrics_add(M_REQUESTS, 1);
+    metrics_add(M_BYTES_IN, n);
+    metrics_add(M_BYTES_OUT, n);
+    metrics_service(metrics_now() - start, 1);
+}
+
+/* 全データの送信 */
+// 0:すべて送った -1:エラー
+static int
+send_all(int acc, const char *p, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(acc, p, len, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return (-1);
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return (0);
+}
+
+/* コピーによる受信と送信 */
+// lenバイトまでrecvし、受信した分をそのまま送る
+// 受信したバイト数 0:EOF -1:エラー
+static ssize_t
+copy_echo(int acc, struct access_info *ai, char *buf, size_t len)
+{
+    uint64_t start;
+    ssize_t n;
+
+    while ((n = recv(acc, buf, len, 0)) == -1) {
+        if (errno != EINTR) {
+            perror("recv");
+            metrics_add(M_RECV_ERRORS, 1);
+            return (-1);
+        }
+    }
+    if (n == 0) {
+        return (0);
+    }
+    start = metrics_now();
+    if (send_all(acc, buf, (size_t) n) == -1) {
+        metrics_add(M_SEND_ERRORS, 1);
+        return (-1);
+    }
+    echo_count(ai, (size_t) n, start);
+    return (n);
+}
+
+/* TCP_ZEROCOPY_RECEIVEによるエコー */
+// 受信キューのページをrecvでコピーせずにmmapした領域へ直接割り当て、そこから送り返す
+// ページに揃わない端数（recv_skip_hint）と、マップできないときはコピーで受信する
+// 応答はsplice同様に受信データそのもの（":OK"の接尾辞は付けない）
+void
+zcrecv_echo(int acc, struct access_info *ai)
+{
+    struct tcp_zerocopy_receive zc;
+    struct pollfd pfd;
+    char buf[ZC_COPY_SIZE];
+    size_t mapped = 0, copied = 0;
+    uint64_t start;
+    socklen_t len;
+    ssize_t n;
+    void *addr;
+
+    // ソケットのmmapはTCP_ZEROCOPY_RECEIVEの割り当て先を予約するだけ
+    if ((addr = mmap(NULL, ZC_MAP_SIZE, PROT_READ, MAP_SHARED, acc, 0)) == MAP_FAILED) {
+        perror("mmap");
+    }
+    for (;;) {
+        if (addr != MAP_FAILED) {
+            /* 受信可能になるまで待つ */
+            // getsockoptは待たないのでpollで待つ
+            pfd.fd = acc;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                metrics_add(M_RECV_ERRORS, 1);
+                ai->reason = ACCESS_ERROR;
+                break;
+            }
+            /* 受信キューのページのマップ */
+            // 前回マップした分はカーネルが外してから新しいページを割り当てる
+            (void) memset(&zc, 0, sizeof(zc));
+            zc.address = (uint64_t) (uintptr_t) addr;
+            zc.length = ZC_MAP_SIZE;
+            len = (socklen_t) sizeof(zc);
+            if (getsockopt(acc, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &len) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EIO) {
+                    // 対応していなければ以降はコピーで受信する
+                    perror("getsockopt(TCP_ZEROCOPY_RECEIVE)");
+                    (void) munmap(addr, ZC_MAP_SIZE);
+                    addr = MAP_FAILED;
+                    continue;
+                }
+                // EIOは受信キューが空でEOFを受け取ったとき（下のrecvでEOFとして扱う）
+                zc.length = 0;
+                zc.recv_skip_hint = 0;
+            }
+            if (zc.length > 0) {
+                start = metrics_now();
+                if (send_all(acc, addr, zc.length) == -1) {
+                    metrics_add(M_SEND_ERRORS, 1);
+                    ai->reason = ACCESS_ERROR;
+                    break;
+                }
+                echo_count(ai, zc.length, start);
+                mapped += zc.length;
+            }
+            if (zc.recv_skip_hint > 0) {
+                /* ページに揃わない端数 */
+                n = copy_echo(acc, ai, buf, zc.recv_skip_hint < sizeof(buf)
+                                ? zc.recv_skip_hint : sizeof(buf));
+                if (n <= 0) {
+                    ai->reason = n == 0 ? ACCESS_EOF : ACCESS_ERROR;
+                    break;
+                }
+                copied += (size_t) n;
+            }
+            if (zc.length > 0 || zc.recv_skip_hint > 0) {
+                continue;
+            }
+        }
+        /* コピーによる受信 */
+        // マップできるほど溜まっていないか、EOF
+        if ((n = copy_echo(acc, ai, buf, sizeof(buf))) <= 0) {
+            if (n == 0) {
+                LOG(LOG_LEVEL_INFO, "recv:EOF\n");
+            } else {
+                ai->reason = ACCESS_ERROR;
+            }
+            break;
+        }
+        copied += (size_t) n;
+    }
+    LOG(LOG_LEVEL_INFO, "zcrecv:mapped=%zu copied=%zu\n", mapped, copied);
+    // 受信したものをそのまま送り返すので送受信のバイト数は同じ
+    ai->bytes_in = ai->bytes_out = mapped + copied;
+    if (addr != MAP_FAILED) {
+        (void) munmap(addr, ZC_MAP_SIZE);
+    }
+}
+
+/* TCP_ZEROCOPY_RECEIVEによるエコーのループ */
+// 1接続ずつ処理するので、並列に扱うには-tや-pと組み合わせる
+void
+zcrecv_loop(int soc)
+{
+    accept_serve(soc, zcrecv_echo);
+}
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <linux/futex.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+/* futexで待つ */
+// *addrがvalのままならtimeout_msミリ秒まで眠る（負なら無期限）
+// 別プロセスと共有するのでFUTEX_PRIVATE_FLAGは付けない
+static void
+futex_wait(uint32_t *addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+    (void) syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+/* futexで眠っている相手を起こす */
+static void
+futex_wake(uint32_t *addr)
+{
+    (void) syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* 眠っていれば起こす */
+// 待つ側のフラグを下ろせたほうだけがfutexを鳴らす
+static void
+shmring_kick(uint32_t *wait)
+{
+    if (__atomic_load_n(wait, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(wait, 0, __ATOMIC_SEQ_CST)) {
+        futex_wake(wait);
+    }
+}
+
+/* 空回りの1回分 */
+static void
+shmring_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* 読み出し（消費者） */
+// 書き込み済みのデータを最大maxバイトdstへコピーしてバイト数を返す
+// 位置は相手も書ける共有メモリにあるので1回だけ読み、
+// 書き込み済みの量がリングより大きければ壊れた相手として-1を返す
+ssize_t
+shmring_read(struct shmring *r, void *dst, size_t max)
+{
+    uint32_t head, tail, used, off;
+    size_t n, first;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if ((used = tail - head) > SHMRING_SIZE) {
+        return (-1);
+    }
+    if ((n = used) > max) {
+        n = max;
+    }
+    if (n == 0) {
+        return (0);
+    }
+    off = head & (SHMRING_SIZE - 1);
+    first = n < SHMRING_SIZE - off ? n : SHMRING_SIZE - off;
+    (void) memcpy(dst, r->data + off, first);
+    (void) memcpy((char *) dst + first, r->data, n - first);
+    __atomic_store_n(&r->head, head + (uint32_t) n, __ATOMIC_SEQ_CST);
+    shmring_kick(&r->wr_wait);
+    return ((ssize_t) n);
+}
+
+/* 書き込み（生産者） */
+// 空いている分だけsrcからコピーして書き込んだバイト数を返す
+// 読み出しと同じく、位置が矛盾していれば壊れた相手として-1を返す
+ssize_t
+shmring_write(struct shmring *r, const void *src, size_t len)
+{
+    uint32_t head, tail, used, off;
+    size_t n, first;
+
+    tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if ((used = tail - head) > SHMRING_SIZE) {
+        return (-1);
+    }
+    if ((n = SHMRING_SIZE - used) > len) {
+        n = len;
+    }
+    if (n == 0) {
+        return (0);
+    }
+    off = tail & (SHMRING_SIZE - 1);
+    first = n < SHMRING_SIZE - off ? n : SHMRING_SIZE - off;
+    (void) memcpy(r->data + off, src, first);
+    (void) memcpy(r->data, (const char *) src + first, n - first);
+    __atomic_store_n(&r->tail, tail + (uint32_t) n, __ATOMIC_SEQ_CST);
+    shmring_kick(&r->rd_wait);
+    return ((ssize_t) n);
+}
+
+/* 待つ条件が満たされたか */
+// dataが真なら読めるデータ、偽なら書ける空きがあるか（閉じられていても真）
+static int
+shmring_ready(struct shmring *r, int data)
+{
+    uint32_t used;
+
+    if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+        return (1);
+    }
+    used = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST)
+        - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+    return (data ? used > 0 : used < SHMRING_SIZE);
+}
+
+/* 眠る前に空回りする回数 */
+// CPUが1つなら空回りしても相手は進まないのですぐ眠る
+static int
+shmring_spin(void)
+{
+    static int spin = -1;
+    int n;
+
+    if ((n = __atomic_load_n(&spin, __ATOMIC_RELAXED)) < 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHMRING_SPIN : 0;
+        __atomic_store_n(&spin, n, __ATOMIC_RELAXED);
+    }
+    return (n);
+}
+
+/* 条件が満たされるまで待つ */
+// しばらく空回りしてから、フラグを立ててfutexで眠る
+// 1:満たされた 0:タイムアウト
+static int
+shmring_wait(struct shmring *r, int data, uint32_t *wait, int timeout_ms)
+{
+    int i, spin;
+
+    spin = shmring_spin();
+    for (i = 0; i < spin; i++) {
+        if (shmring_ready(r, data)) {
+            return (1);
+        }
+        shmring_relax();
+    }
+    __atomic_store_n(wait, 1, __ATOMIC_SEQ_CST);
+    // フラグを立てた後に見直して、取りこぼしがないようにする
+    if (!shmring_ready(r, data)) {
+        futex_wait(wait, 1, timeout_ms);
+    }
+    __atomic_store_n(wait, 0, __ATOMIC_RELAXED);
+    return (shmring_ready(r, data));
+}
+
+/* 読めるデータが来るまで待つ（消費者） */
+// 1:読める（または閉じられた） 0:タイムアウト
+int
+shmring_wait_data(struct shmring *r, int timeout_ms)
+{
+    return (shmring_wait(r, 1, &r->rd_wait, timeout_ms));
+}
+
+/* 書ける空きができるまで待つ（生産者） */
+// 1:書ける（または閉じられた） 0:タイムアウト
+int
+shmring_wait_space(struct shmring *r, int timeout_ms)
+{
+    return (shmring_wait(r, 0, &r->wr_wait, timeout_ms));
+}
+
+/* リングを閉じる */
+// 生産者なら書き終えたこと、消費者なら読まなくなったことを相手に伝える
+void
+shmring_close(struct shmring *r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->rd_wait, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->wr_wait, 0, __ATOMIC_SEQ_CST);
+    futex_wake(&r->rd_wait);
+    futex_wake(&r->wr_wait);
+}
+
+/* リングが閉じられたか */
+int
+shmring_closed(const struct shmring *r)
+{
+    return (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) != 0);
+}
+
+/* 共有メモリセグメントの作成（サーバー） */
+// 名前のないmemfdに作り、fdはソケットで相手に渡す
+struct shmseg *
+shmseg_create(int *fd)
+{
+    struct shmseg *seg;
+
+    if ((*fd = memfd_create("server-shm", MFD_CLOEXEC)) == -1) {
+        perror("memfd_create");
+        return (NULL);
+    }
+    if (ftruncate(*fd, (off_t) sizeof(*seg)) == -1) {
+        perror("ftruncate");
+        (void) close(*fd);
+        return (NULL);
+    }
+    if ((seg = shmseg_map(*fd)) == NULL) {
+        (void) close(*fd);
+        return (NULL);
+    }
+    // ftruncateで伸ばした部分は0なので、リングは空の状態になっている
+    seg->size = sizeof(*seg);
+    __atomic_store_n(&seg->magic, SHMSEG_MAGIC, __ATOMIC_RELEASE);
+    return (seg);
+}
+
+/* 共有メモリセグメントのマップ */
+// 作成済みのセグメントならサイズと識別子を確かめる
+struct shmseg *
+shmseg_map(int fd)
+{
+    struct shmseg *seg;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return (NULL);
+    }
+    if ((size_t) st.st_size != sizeof(*seg)) {
+        (void) fprintf(stderr, "shmseg:size mismatch %lld\n", (long long) st.st_size);
+        return (NULL);
+    }
+    if ((seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+            == MAP_FAILED) {
+        perror("mmap");
+        return (NULL);
+    }
+    if (seg->magic != 0
+            && (seg->magic != SHMSEG_MAGIC || seg->size != sizeof(*seg))) {
+        (void) fprintf(stderr, "shmseg:bad segment\n");
+        shmseg_unmap(seg);
+        return (NULL);
+    }
+    return (seg);
+}
+
+/* 共有メモリセグメントのアンマップ */
+void
+shmseg_unmap(struct shmseg *seg)
+{
+    (void) munmap(seg, sizeof(*seg));
+}
+
+/* セグメントのfdを相手に渡す（サーバー） */
+// Unixドメインソケットの補助データ（SCM_RIGHTS）で送る
+// 0:成功 -1:エラー
+int
+shmseg_send(int soc, int fd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char c = 0;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    (void) memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    (void) memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(soc, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        return (-1);
+    }
+    return (0);
+}
+
+/* セグメントの受け取りとマップ（クライアント） */
+// サーバーが送ったfdを受け取ってマップし、fdは閉じる
+struct shmseg *
+shmseg_connect(int soc)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct shmseg *seg;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t n;
+    char c;
+    int fd;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    while ((n = recvmsg(soc, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (n == -1) {
+            perror("recvmsg");
+        } else {
+            (void) fprintf(stderr, "recvmsg:EOF\n");
+        }
+        return (NULL);
+    }
+    if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+            || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        (void) fprintf(stderr, "shmseg:no descriptor\n");
+        return (NULL);
+    }
+    (void) memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    seg = shmseg_map(fd);
+    (void) close(fd);
+    if (seg != NULL && seg->magic != SHMSEG_MAGIC) {
+        (void) fprintf(stderr, "shmseg:bad segment\n");
+        shmseg_unmap(seg);
+        return (NULL);
+    }
+    return (seg);
+}
+
+/* 相手がいなくなったか */
+// リングは相手の異常終了を伝えられないので、つないだままのソケットで確かめる
+// 1:切断された 0:つながっている
+int
+shmseg_peer_gone(int soc)
+{
+    ssize_t n;
+    char c;
+
+    if ((n = recv(soc, &c, 1, MSG_PEEK | MSG_DONTWAIT)) == 0) {
+        return (1);
+    }
+    return (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
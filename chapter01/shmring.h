@@ -0,0 +1,51 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+/* リング1つのデータ領域のサイズ（2のべき乗） */
+#define SHMRING_SIZE (1024 * 1024)
+/* 共有メモリセグメントの識別子（"SHM1"） */
+#define SHMSEG_MAGIC 0x53484d31
+/* 眠る前に空回りして待つ回数 */
+#define SHMRING_SPIN 2000
+
+/* 共有メモリ上の単一生産者・単一消費者のバイトリング */
+// 生産者はtail、消費者はheadだけを進め、ロックもシステムコールも使わない
+// 相手が眠っているとき（*_waitが立っているとき）だけfutexで起こす
+struct shmring {
+    // 生産者と消費者が触る変数はキャッシュラインを分ける
+    uint32_t tail __attribute__((aligned(64)));     // 書き込み済みの位置
+    uint32_t head __attribute__((aligned(64)));     // 読み出し済みの位置
+    uint32_t rd_wait __attribute__((aligned(64)));  // 消費者がデータを待って眠っている
+    uint32_t wr_wait __attribute__((aligned(64)));  // 生産者が空きを待って眠っている
+    uint32_t closed __attribute__((aligned(64)));   // 以降は書き込まない（相手がいない）
+    char data[SHMRING_SIZE] __attribute__((aligned(64)));
+};
+
+/* 共有メモリセグメント */
+// 要求（クライアント→サーバー）と応答（サーバー→クライアント）のリングの組
+struct shmseg {
+    uint32_t magic;
+    uint32_t size;      // sizeof(struct shmseg)
+    struct shmring req;
+    struct shmring resp;
+};
+
+/* shmring.c */
+ssize_t shmring_read(struct shmring *r, void *dst, size_t max);
+ssize_t shmring_write(struct shmring *r, const void *src, size_t len);
+int shmring_wait_data(struct shmring *r, int timeout_ms);
+int shmring_wait_space(struct shmring *r, int timeout_ms);
+void shmring_close(struct shmring *r);
+int shmring_closed(const struct shmring *r);
+struct shmseg *shmseg_create(int *fd);
+struct shmseg *shmseg_map(int fd);
+void shmseg_unmap(struct shmseg *seg);
+int shmseg_send(int soc, int fd);
+struct shmseg *shmseg_connect(int soc);
+int shmseg_peer_gone(int soc);
+
+#endif
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+/* スレッドごとのキャッシュ */
+// サイズクラスごとに空き要素を単方向リストでつなぎ、ロックなしで出し入れする
+// 空きがなければOSから確保した領域の先頭から切り出す
+struct slab_cache {
+    void *free[SLAB_CLASSES];
+    char *cur;          // 切り出していない領域の先頭
+    size_t left;        // その残りのバイト数
+};
+
+static __thread struct slab_cache cache;
+/* ヒュージページで確保するか */
+static int slab_huge;
+/* 統計 */
+static struct slab_stats stats;
+
+/* アロケータの初期化 */
+// hugepagesが真ならOSからの確保にヒュージページを使う
+// スレッドを作る前に呼ぶ
+void
+slab_init(int hugepages)
+{
+    slab_huge = hugepages;
+}
+
+/* サイズクラスの番号 */
+// 最大のサイズクラスを超えれば-1
+static int
+slab_class(size_t size)
+{
+    int c;
+
+    if (size <= ((size_t) 1 << SLAB_MIN_SHIFT)) {
+        return (0);
+    }
+    // size-1の最上位ビットの位置で2のべき乗に切り上げる
+    c = (int) (sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long) size - 1)
+        - SLAB_MIN_SHIFT;
+    return (c < SLAB_CLASSES ? c : -1);
+}
+
+/* OSからの領域の確保 */
+// SLAB_CHUNKに揃えて確保し、透過的ヒュージページにもなりやすくする
+static char *
+slab_chunk(void)
+{
+    char *p, *q;
+    size_t head;
+
+    if (slab_huge) {
+        // 予約済みのヒュージページがあればそれを使う
+        p = mmap(NULL, SLAB_CHUNK, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            __atomic_add_fetch(&stats.chunks, 1, __ATOMIC_RELAXED);
+            return (p);
+        }
+    }
+    // 揃えるために倍の大きさで確保して前後を返す
+    if ((p = mmap(NULL, SLAB_CHUNK * 2, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (NULL);
+    }
+    q = (char *) (((uintptr_t) p + SLAB_CHUNK - 1) & ~((uintptr_t) SLAB_CHUNK - 1));
+    head = (size_t) (q - p);
+    if (head > 0) {
+        (void) munmap(p, head);
+    }
+    (void) munmap(q + SLAB_CHUNK, SLAB_CHUNK - head);
+    if (slab_huge) {
+        (void) madvise(q, SLAB_CHUNK, MADV_HUGEPAGE);
+    }
+    __atomic_add_fetch(&stats.chunks, 1, __ATOMIC_RELAXED);
+    return (q);
+}
+
+/* 空き要素の追加 */
+static void
+slab_push(struct slab_cache *sc, int c, void *p)
+{
+    *(void **) p = sc->free[c];
+    sc->free[c] = p;
+}
+
+/* 領域の切り出し */
+// 残りが足りなければ、残りを小さいサイズクラスの空き要素にしてから新しく確保する
+// サイズクラスはすべて64バイト以上の2のべき乗なので、切り出した要素は64バイト境界に揃う
+static void *
+slab_carve(struct slab_cache *sc, int c)
+{
+    size_t size = (size_t) 1 << (SLAB_MIN_SHIFT + c);
+    char *p;
+    int k;
+
+    if (sc->left < size) {
+        for (k = c - 1; k >= 0 && sc->left > 0; k--) {
+            while (sc->left >= ((size_t) 1 << (SLAB_MIN_SHIFT + k))) {
+                slab_push(sc, k, sc->cur);
+                sc->cur += (size_t) 1 << (SLAB_MIN_SHIFT + k);
+                sc->left -= (size_t) 1 << (SLAB_MIN_SHIFT + k);
+            }
+        }
+        if ((p = slab_chunk()) == NULL) {
+            return (NULL);
+        }
+        sc->cur = p;
+        sc->left = SLAB_CHUNK;
+    }
+    p = sc->cur;
+    sc->cur += size;
+    sc->left -= size;
+    return (p);
+}
+
+/* 確保 */
+// 同じスレッドの空きリストから取り出すだけで、定常状態ではOSもmallocも呼ばない
+void *
+slab_alloc(size_t size)
+{
+    struct slab_cache *sc = &cache;
+    void *p;
+    int c;
+
+    if ((c = slab_class(size)) == -1) {
+        __atomic_add_fetch(&stats.large, 1, __ATOMIC_RELAXED);
+        return (malloc(size));
+    }
+    if ((p = sc->free[c]) != NULL) {
+        sc->free[c] = *(void **) p;
+        return (p);
+    }
+    return (slab_carve(sc, c));
+}
+
+/* 0で埋めた確保 */
+void *
+slab_zalloc(size_t size)
+{
+    void *p;
+
+    if ((p = slab_alloc(size)) != NULL) {
+        (void) memset(p, 0, size);
+    }
+    return (p);
+}
+
+/* 大きさの変更 */
+// oldは確保したときの大きさで、同じサイズクラスに収まればそのまま返す
+// NULL:確保できなかった（pはそのまま）
+void *
+slab_realloc(void *p, size_t old, size_t size)
+{
+    void *q;
+    int c;
+
+    if ((c = slab_class(size)) != -1 && c == slab_class(old)) {
+        return (p);
+    }
+    if (c == -1 && slab_class(old) == -1) {
+        return (realloc(p, size));
+    }
+    if ((q = slab_alloc(size)) == NULL) {
+        return (NULL);
+    }
+    (void) memcpy(q, p, old < size ? old : size);
+    slab_free(p, old);
+    return (q);
+}
+
+/* 解放 */
+// sizeは確保したときの大きさ
+// 別のスレッドで確保した要素も、解放したスレッドの空きリストに入れて使い回す
+void
+slab_free(void *p, size_t size)
+{
+    int c;
+
+    if (p == NULL) {
+        return;
+    }
+    if ((c = slab_class(size)) == -1) {
+        free(p);
+        return;
+    }
+    slab_push(&cache, c, p);
+}
+
+/* 統計の取得 */
+void
+slab_stats(struct slab_stats *st)
+{
+    st->chunks = __atomic_load_n(&stats.chunks, __ATOMIC_RELAXED);
+    st->large = __atomic_load_n(&stats.large, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,29 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <sys/types.h>
+
+/* 最小のサイズクラス（2のべき乗の指数） */
+#define SLAB_MIN_SHIFT 6
+/* 最大のサイズクラス（これより大きいものはmallocに任せる） */
+#define SLAB_MAX_SHIFT 20
+/* サイズクラスの数 */
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+/* OSから一度に確保する領域のサイズ（ヒュージページ1枚分） */
+#define SLAB_CHUNK (2 * 1024 * 1024)
+
+/* 統計（全スレッドの合計） */
+struct slab_stats {
+    unsigned long chunks;   // OSから確保した領域の数
+    unsigned long large;    // 最大のサイズクラスを超えてmallocした回数
+};
+
+/* slab.c */
+void slab_init(int hugepages);
+void *slab_alloc(size_t size);
+void *slab_zalloc(size_t size);
+void *slab_realloc(void *p, size_t old, size_t size);
+void slab_free(void *p, size_t size);
+void slab_stats(struct slab_stats *st);
+
+#endif
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "statshm.h"
+
+/* 書き込み中のスロットを読み直す最大回数 */
+#define STATSHM_RETRY 1000
+
+/* 書き込み先のセグメント */
+// マスターが作成してマップし、fork後のワーカーもマップを共有する
+static struct statshm *g_stat;
+
+/* 現在時刻（エポックからのナノ秒） */
+static uint64_t
+wall_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+/* 統計の加算 */
+void
+statshm_sum(struct metrics_snap *dst, const struct metrics_snap *src)
+{
+    int i;
+
+    for (i = 0; i < M_COUNTERS; i++) {
+        dst->c[i] += src->c[i];
+    }
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        dst->service.buckets[i] += src->service.buckets[i];
+    }
+    dst->service.count += src->service.count;
+    dst->service.sum += src->service.sum;
+}
+
+/* セグメントを作ったプロセスが動いているか */
+// 識別子のない（作り直し途中や別物の）セグメントは持ち主なしとみなす
+// 持ち主のpid（いなければ0）を返す
+static pid_t
+statshm_owner(int fd)
+{
+    const struct statshm_hdr *hdr;
+    struct stat sb;
+    pid_t pid = 0;
+
+    if (fstat(fd, &sb) == -1 || (size_t) sb.st_size < sizeof(*hdr)) {
+        return (0);
+    }
+    if ((hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        return (0);
+    }
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == STATSHM_MAGIC) {
+        pid = (pid_t) hdr->pid;
+    }
+    (void) munmap((void *) hdr, sizeof(*hdr));
+    // 自分と同じpidは、前の起動のpidがたまたま一致しただけ
+    if (pid <= 0 || pid == getpid() || (kill(pid, 0) == -1 && errno != EPERM)) {
+        return (0);
+    }
+    return (pid);
+}
+
+/* 統計セグメントの作成 */
+// 前回の起動で残ったセグメントは作り直し、全スロットを未使用にする
+// 動いているサーバーのセグメントは統計を消さないよう作り直さない
+// 0:成功 -1:エラー
+int
+statshm_create(const char *name)
+{
+    struct statshm *st;
+    pid_t owner;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+        perror("shm_open");
+        return (-1);
+    }
+    // 大きさを変える前に確かめ、別の版のサーバーのセグメントも縮めない
+    if ((owner = statshm_owner(fd)) != 0) {
+        (void) fprintf(stderr, "%s:in use by pid %d\n", name, (int) owner);
+        (void) close(fd);
+        return (-1);
+    }
+    if (ftruncate(fd, sizeof(*st)) == -1) {
+        perror("ftruncate");
+        (void) close(fd);
+        return (-1);
+    }
+    if ((st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(fd);
+        return (-1);
+    }
+    (void) close(fd);
+    // 読む側が作り直し途中の見出しを信じないよう、識別子は最後に書く
+    __atomic_store_n(&st->hdr.magic, 0, __ATOMIC_RELAXED);
+    (void) memset(st->slots, 0, sizeof(st->slots));
+    st->hdr.version = STATSHM_VERSION;
+    st->hdr.nslots = STATSHM_SLOTS;
+    st->hdr.slot_size = sizeof(struct statshm_slot);
+    st->hdr.ncounters = M_COUNTERS;
+    st->hdr.nbuckets = METRICS_BUCKETS;
+    st->hdr.pid = (int32_t) getpid();
+    st->hdr.created_ns = wall_ns();
+    __atomic_store_n(&st->hdr.magic, STATSHM_MAGIC, __ATOMIC_RELEASE);
+    g_stat = st;
+    return (0);
+}
+
+/* スロットへの書き込み */
+// seqを奇数にしてから書き、書き終えたら偶数に戻す
+static void
+statshm_publish(struct statshm_slot *slot, const struct metrics_snap *snap)
+{
+    uint32_t seq = slot->seq;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    (void) memcpy(&slot->snap, snap, sizeof(*snap));
+    slot->updated_ns = wall_ns();
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* 書き出しスレッド */
+// 送受信のスレッドはスレッドごとの集計を数えるだけで、共有メモリには触らない
+// このスレッドが一定間隔で合計を取り、前のワーカーから引き継いだ分を足して書く
+static void *
+statshm_thread(void *arg)
+{
+    struct statshm_slot *slot = arg;
+    struct metrics_snap base, snap;
+    struct timespec ts;
+
+    // 再起動されたワーカーは同じスロットの値に足し込み、合計を減らさない
+    // 前のワーカーの接続はもう閉じているので、接続中の数には残さない
+    (void) memcpy(&base, &slot->snap, sizeof(base));
+    base.c[M_CLOSES] = base.c[M_ACCEPTS];
+    ts.tv_sec = 0;
+    ts.tv_nsec = STATSHM_PUBLISH_MS * 1000000L;
+    for (;;) {
+        metrics_snapshot(&snap);
+        statshm_sum(&snap, &base);
+        statshm_publish(slot, &snap);
+        (void) nanosleep(&ts, NULL);
+    }
+    return (NULL);
+}
+
+/* 自分のスロットへの書き出しの開始 */
+// idは事前forkのワーカー番号（それ以外は0）で、再起動されても同じスロットを使う
+// セグメントを作っていなければ何もしない
+// 0:成功 -1:エラー
+int
+statshm_attach(int id)
+{
+    struct statshm_slot *slot;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int err;
+
+    if (g_stat == NULL) {
+        return (0);
+    }
+    if (id < 0 || id >= STATSHM_SLOTS) {
+        (void) fprintf(stderr, "statshm:no slot for worker %d\n", id);
+        return (-1);
+    }
+    slot = &g_stat->slots[id];
+    // 前のワーカーが書き込み中に落ちていたらseqを偶数に戻す
+    if (slot->seq & 1) {
+        __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    }
+    slot->pid = (int32_t) getpid();
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, statshm_thread, slot);
+    (void) pthread_attr_destroy(&attr);
+    if (err != 0) {
+        (void) fprintf(stderr, "pthread_create:%s\n", strerror(err));
+        return (-1);
+    }
+    return (0);
+}
+
+/* 統計セグメントを読み出し用に開く */
+// 形が違うセグメント（別の版のサーバー）はNULLを返す
+const struct statshm *
+statshm_open(const char *name)
+{
+    const struct statshm *st;
+    struct stat sb;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0)) == -1) {
+        perror(name);
+        return (NULL);
+    }
+    if (fstat(fd, &sb) == -1 || (size_t) sb.st_size < sizeof(*st)) {
+        (void) fprintf(stderr, "%s:not a stats segment\n", name);
+        (void) close(fd);
+        return (NULL);
+    }
+    if ((st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(fd);
+        return (NULL);
+    }
+    (void) close(fd);
+    if (__atomic_load_n(&st->hdr.magic, __ATOMIC_ACQUIRE) != STATSHM_MAGIC
+            || st->hdr.version != STATSHM_VERSION || st->hdr.nslots != STATSHM_SLOTS
+            || st->hdr.slot_size != sizeof(struct statshm_slot)
+            || st->hdr.ncounters != M_COUNTERS || st->hdr.nbuckets != METRICS_BUCKETS) {
+        (void) fprintf(stderr, "%s:not a stats segment\n", name);
+        (void) munmap((void *) st, sizeof(*st));
+        return (NULL);
+    }
+    return (st);
+}
+
+/* スロットの一貫した読み出し */
+// システムコールなしでコピーし、書き込みと重なったら読み直す
+// 0:成功（未使用ならout->pidが0） -1:書き込み中のまま読めなかった
+int
+statshm_read(const struct statshm_slot *slot, struct statshm_slot *out)
+{
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < STATSHM_RETRY; i++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            // 書き出しスレッドが途中で止まっているかもしれないので譲る
+            (void) sched_yield();
+            continue;
+        }
+        (void) memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return (0);
+        }
+    }
+    return (-1);
+}
@@ -0,0 +1,55 @@
+#ifndef STATSHM_H
+#define STATSHM_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "metrics.h"
+
+/* セグメントの識別子（"STAT"） */
+#define STATSHM_MAGIC 0x54415453
+/* 形式の版 */
+#define STATSHM_VERSION 1
+/* スロット数（事前forkのワーカー番号ごとに1つ、それ以外は0番だけ使う） */
+#define STATSHM_SLOTS 128
+/* 各プロセスが自分のスロットへ書き出す間隔（ミリ秒） */
+#define STATSHM_PUBLISH_MS 10
+
+/* セグメントの見出し */
+// 読む側はmagicとversionに加え、大きさと数が自分の知っている形と同じか確かめる
+struct statshm_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nslots;
+    uint32_t slot_size;     // 1スロットの大きさ
+    uint16_t ncounters;     // M_COUNTERS
+    uint16_t nbuckets;      // METRICS_BUCKETS
+    int32_t pid;            // 作成したプロセス
+    uint64_t created_ns;    // 作成した時刻（エポックからのナノ秒）
+} __attribute__((aligned(64)));
+
+/* 1プロセス分の統計 */
+// 書くのはそのプロセスの書き出しスレッドだけで、seqが奇数の間は書き込み中
+// 読む側はseqが偶数で前後とも同じ値のときのコピーだけを使う
+struct statshm_slot {
+    uint32_t seq;
+    int32_t pid;            // 書いているプロセス（0なら未使用）
+    uint64_t updated_ns;    // 最後に書いた時刻（エポックからのナノ秒）
+    struct metrics_snap snap;
+} __attribute__((aligned(64)));
+
+/* セグメント全体 */
+struct statshm {
+    struct statshm_hdr hdr;
+    struct statshm_slot slots[STATSHM_SLOTS];
+};
+
+/* statshm.c */
+int statshm_create(const char *name);
+int statshm_attach(int id);
+const struct statshm *statshm_open(const char *name);
+int statshm_read(const struct statshm_slot *slot, struct statshm_slot *out);
+void statshm_sum(struct metrics_snap *dst, const struct metrics_snap *src);
+
+#endif